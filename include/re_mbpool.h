@@ -0,0 +1,22 @@
+/**
+ * @file re_mbpool.h  Interface to the Buffer Pool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/** Buffer pool statistics */
+struct mbpool_stats {
+	uint64_t n_hit;              /**< Buffers taken from the pool       */
+	uint64_t n_miss;             /**< Buffers allocated                 */
+	uint64_t n_put;              /**< Buffers returned to the pool      */
+	uint64_t n_drop;             /**< Buffers freed, not pooled         */
+	size_t bytes;                /**< Bytes kept in the pool            */
+};
+
+
+struct mbuf *mbpool_alloc(size_t size);
+void *mbpool_put(struct mbuf *mb);
+void  mbpool_flush(void);
+void  mbpool_stats_get(struct mbpool_stats *stats);
+int   mbpool_debug(struct re_printf *pf, void *unused);
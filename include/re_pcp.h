@@ -70,6 +70,7 @@ enum pcp_option_code {
 
 /* forward declarations */
 struct udp_sock;
+struct tmrw;
 
 /** Defines a PCP option */
 struct pcp_option {
@@ -136,6 +137,7 @@ struct pcp_conf {
 	uint32_t mrc;  /**< Maximum retransmission count              */
 	uint32_t mrt;  /**< Maximum retransmission time [seconds]     */
 	uint32_t mrd;  /**< Maximum retransmission duration [seconds] */
+	struct tmrw *tmrw; /**< Timer wheel for the timers (optional) */
 };
 
 
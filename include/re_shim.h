@@ -7,9 +7,23 @@ enum { SHIM_HDR_SIZE = 2 };
 
 struct shim;
 
+/** SHIM limits, zero is no limit */
+struct shim_conf {
+	size_t max_frame;     /**< Larger frames are dropped            */
+	size_t max_buffered;  /**< Buffered bytes before closing        */
+};
+
 typedef bool (shim_frame_h)(struct mbuf *mb, void *arg);
+/** Frames not handled by the frame handler, as read-only views */
+typedef void (shim_framev_h)(struct mbuf **mbv, size_t n, void *arg);
 
 
 int shim_insert(struct shim **shimp, struct tcp_conn *tc, int layer,
-		shim_frame_h *frameh, void *arg);
+		const struct shim_conf *conf, shim_frame_h *frameh, void *arg);
+int shim_sendv(struct shim *shim, struct mbuf **mbv, size_t n);
+struct mbuf *shim_mbuf_alloc(size_t size);
+void shim_set_framev_handler(struct shim *shim, shim_framev_h *framevh);
+void shim_pause(struct shim *shim);
+int shim_resume(struct shim *shim);
+size_t shim_buffered(const struct shim *shim);
 int shim_debug(struct re_printf *pf, const struct shim *shim);
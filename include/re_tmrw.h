@@ -0,0 +1,32 @@
+/**
+ * @file re_tmrw.h  Interface to Timer Wheel
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+struct tmrw;
+
+
+/**
+ * Defines a timer, that runs on a timer wheel, or on the main timer
+ * list if no timer wheel is given
+ */
+struct tmrw_ent {
+	struct tmr tmr;              /**< Main timer, used without a wheel  */
+	struct le le;                /**< Element in a slot of the wheel    */
+	struct tmrw *w;              /**< Timer wheel, while running on it  */
+	uint64_t expires;            /**< Expiry time in ticks              */
+	tmr_h *th;                   /**< Timeout handler                   */
+	void *arg;                   /**< Handler argument                  */
+};
+
+
+int      tmrw_alloc(struct tmrw **wp, uint32_t tick);
+int      tmrw_debug(struct re_printf *pf, const struct tmrw *w);
+void     tmrw_init(struct tmrw_ent *te);
+void     tmrw_start(struct tmrw *w, struct tmrw_ent *te, uint64_t delay,
+		    tmr_h *th, void *arg);
+void     tmrw_cancel(struct tmrw_ent *te);
+bool     tmrw_isrunning(const struct tmrw_ent *te);
+uint64_t tmrw_get_expire(const struct tmrw_ent *te);
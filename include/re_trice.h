@@ -12,12 +12,43 @@ struct trice_conf {
 	bool trace;             /**< Enable tracing of Connectivity checks */
 	bool ansi;              /**< Enable ANSI colors for debug output   */
 	bool enable_prflx;      /**< Enable Peer-Reflexive candidates      */
+	uint32_t rx_batch;      /**< Max datagrams per UDP receive, 0=off  */
+	uint32_t check_burst;   /**< Max checks per pacing tick, 0=one     */
+	uint32_t req_rate;      /**< Requests/s per source address, 0=off  */
+	uint32_t req_burst;     /**< Request burst per source, 0=req_rate  */
 };
 
 struct trice;
+struct trice_fndgrp;
 struct ice_lcand;
 struct ice_candpair;
 struct stun_conf;
+struct trice_rxbatch;
+struct trice_pacer;
+struct trice_consent;
+struct trice_mux;
+struct tmrw;
+
+
+enum {
+	ICE_LCAND_BATCH_BINS = 6   /**< Batch histogram: 1,2,4,8,16,32+ */
+};
+
+
+/** Policy for selecting a valid candidate pair */
+enum trice_select {
+	TRICE_SELECT_PRIO = 0,     /**< Highest pair priority           */
+	TRICE_SELECT_RTT,          /**< Lowest smoothed round-trip time */
+};
+
+
+/** Round-trip time estimate (RFC 6298), all values in [us] */
+struct trice_rtt {
+	uint32_t last;             /**< Latest sample                   */
+	uint32_t srtt;             /**< Smoothed round-trip time        */
+	uint32_t rttvar;           /**< Round-trip time variation       */
+	uint32_t n;                /**< Number of samples               */
+};
 
 
 typedef bool (ice_cand_recv_h)(struct ice_lcand *lcand,
@@ -29,14 +60,22 @@ typedef bool (ice_cand_recv_h)(struct ice_lcand *lcand,
 struct ice_lcand {
 	struct ice_cand_attr attr;   /**< Base class (inheritance)           */
 	struct le le;                /**< List element                       */
+	struct le he;                /**< Hash element                       */
+	uint32_t fndid;              /**< Interned foundation                */
+	uint32_t prio_prflx;         /**< PRIORITY for outgoing checks       */
+	struct mbuf *chk_tmpl;       /**< Encoded check, without TID and MI  */
+	uint32_t chk_gen;            /**< Generation of the check template   */
 
 	/* Base-address only set for SRFLX, PRFLX, RELAY */
 	struct sa base_addr;    /* IP-address of "base" candidate (optional) */
 
 	struct udp_sock *us;
 	struct udp_helper *uh;
+	struct trice_rxbatch *rxb; /* batched UDP receive (optional) */
 	struct tcp_sock *ts;    /* TCP for simultaneous-open or passive. */
 	char ifname[32];        /**< Network interface, for diagnostics */
+	struct trice_rtt rtt;   /**< Round-trip time, for check timeouts */
+	uint32_t rto_backoff;   /**< Backed-off check timeout [ms], 0=none */
 	int layer;
 	ice_cand_recv_h *recvh;
 	void *arg;
@@ -47,6 +86,11 @@ struct ice_lcand {
 	struct {
 		size_t n_tx;
 		size_t n_rx;
+		size_t n_stun;     /**< Received STUN packets           */
+		size_t n_dtls;     /**< Received DTLS packets           */
+		size_t n_rtp;      /**< Received RTP/RTCP packets       */
+		size_t n_other;    /**< Received other packets          */
+		size_t batchv[ICE_LCAND_BATCH_BINS]; /**< Batch sizes   */
 	} stats;
 };
 
@@ -54,14 +98,20 @@ struct ice_lcand {
 struct ice_rcand {
 	struct ice_cand_attr attr;   /**< Base class (inheritance)           */
 	struct le le;                /**< List element                       */
+	struct le he;                /**< Hash element                       */
+	uint32_t fndid;              /**< Interned foundation                */
 };
 
 
 /** Defines a candidate pair */
 struct ice_candpair {
 	struct le le;                /**< List element                       */
+	struct le he;                /**< Hash element                       */
+	struct le sle;               /**< State bucket element               */
+	struct le fle;               /**< Foundation group element           */
 	struct ice_lcand *lcand;     /**< Local candidate                    */
 	struct ice_rcand *rcand;     /**< Remote candidate                   */
+	struct trice_fndgrp *grp;    /**< Foundation group                   */
 	enum ice_candpair_state state;/**< Candidate pair state              */
 	uint64_t pprio;              /**< Pair priority                      */
       //bool def;                    /**< Default flag                       */
@@ -71,6 +121,8 @@ struct ice_candpair {
 	bool trigged;
 	int err;                     /**< Saved error code, if failed        */
 	uint16_t scode;              /**< Saved STUN code, if failed         */
+	struct trice_rtt rtt;        /**< Round-trip time of checks          */
+	struct trice_consent *consent; /**< Consent freshness (optional)     */
 
 	struct tcp_conn *tc;
 
@@ -86,6 +138,20 @@ typedef void (trice_failed_h)(int err, uint16_t scode,
 			    struct ice_candpair *pair, void *arg);
 
 
+typedef void (trice_consent_h)(struct ice_candpair *pair, int err,
+			       void *arg);
+
+
+typedef void (trice_mux_recv_h)(struct ice_lcand *lcand, int proto,
+				void *sock, const struct sa *src,
+				struct mbuf *mb, void *arg);
+
+
+/** Frames of a TCP connection that are not STUN, as read-only views */
+typedef void (trice_tcp_framev_h)(struct tcp_conn *tc, const struct sa *src,
+				  struct mbuf **mbv, size_t n, void *arg);
+
+
 int  trice_alloc(struct trice **icemp, const struct trice_conf *conf,
 		 enum ice_role role, const char *lufrag, const char *lpwd);
 int  trice_set_remote_ufrag(struct trice *icem, const char *rufrag);
@@ -138,11 +204,33 @@ struct list *trice_checkl(const struct trice *icem);
 struct list *trice_validl(const struct trice *icem);
 struct ice_candpair *trice_candpair_find_state(const struct list *lst,
 					   enum ice_candpair_state state);
+struct ice_candpair *trice_candpair_select(const struct trice *icem,
+					   unsigned compid,
+					   enum trice_select policy,
+					   uint32_t tol);
 int  trice_candpair_debug(struct re_printf *pf, const struct ice_candpair *cp);
 int  trice_candpairs_debug(struct re_printf *pf, bool ansi_output,
 			   const struct list *list);
 
 
+/* Shared pacer */
+int  trice_pacer_alloc(struct trice_pacer **pacerp, uint32_t interval);
+int  trice_pacer_debug(struct re_printf *pf, const struct trice_pacer *pacer);
+int  trice_set_pacer(struct trice *icem, struct trice_pacer *pacer);
+
+
+/* ICE-lite on a shared socket */
+int  trice_mux_alloc(struct trice_mux **muxp, const struct sa *laddr,
+		     bool tcp);
+int  trice_mux_attach(struct trice_mux *mux, struct trice *icem,
+		      unsigned compid, trice_mux_recv_h *recvh, void *arg);
+int  trice_mux_debug(struct re_printf *pf, const struct trice_mux *mux);
+
+
+/* Timer wheel */
+int  trice_set_tmrw(struct trice *icem, struct tmrw *tmrw);
+
+
 /* ICE checklist */
 void trice_checklist_set_waiting(struct trice *icem);
 int  trice_checklist_start(struct trice *icem, struct stun *stun,
@@ -154,6 +242,18 @@ bool trice_checklist_isrunning(const struct trice *icem);
 bool trice_checklist_iscompleted(const struct trice *icem);
 
 
+/* Consent freshness */
+void trice_set_consent_handler(struct trice *icem, trice_consent_h *consenth,
+			       void *arg);
+int  trice_consent_start(struct trice *icem, struct ice_candpair *pair);
+void trice_consent_stop(struct ice_candpair *pair);
+
+
+/* TCP-connections */
+void trice_set_tcp_framev_handler(struct trice *icem,
+				  trice_tcp_framev_h *framevh, void *arg);
+
+
 /* ICE Conncheck */
 int trice_conncheck_send(struct trice *icem, struct ice_candpair *pair,
 			bool use_cand);
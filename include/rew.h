@@ -12,8 +12,10 @@ extern "C" {
 #endif
 
 
+#include "re_mbpool.h"
 #include "re_pcp.h"
 #include "re_shim.h"
+#include "re_tmrw.h"
 #include "re_trice.h"
 
 
@@ -0,0 +1,190 @@
+/**
+ * @file mbpool.c  Buffer Pool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_mbpool.h>
+
+
+/*
+ * A process-wide pool of buffers in size classes, for buffers that are
+ * taken and returned at a high rate, such as re-assembly buffers. A
+ * request is rounded up to its class, and served from the free buffers
+ * of the class. A returned buffer of a class size is kept, up to the
+ * bytes of the class. Larger buffers are allocated and freed as usual.
+ *
+ * The pool is not locked, and must be used from one thread only, the
+ * thread of the main loop.
+ *
+ * The buffers kept in the pool are only freed by mbpool_flush(). An
+ * application calls it at shutdown, before mem_debug(), or the kept
+ * buffers are reported as leaks.
+ */
+
+
+enum {
+	MBPOOL_CLASSES     = 4,
+	MBPOOL_CLASS_BYTES = 262144,   /* Bytes kept per class            */
+	MBPOOL_FREE_MAX    = 256,      /* Buffers kept, in smallest class */
+};
+
+
+struct mbpool_class {
+	size_t size;
+	struct mbuf *freev[MBPOOL_FREE_MAX];
+	unsigned n;
+};
+
+
+static struct {
+	struct mbpool_class classv[MBPOOL_CLASSES];
+	struct mbpool_stats stats;
+} pool = {
+	{
+		{1024,  {NULL}, 0},
+		{4096,  {NULL}, 0},
+		{16384, {NULL}, 0},
+		{65540, {NULL}, 0},  /* largest RFC 4571 frame, with header */
+	},
+	{0, 0, 0, 0, 0}
+};
+
+
+static struct mbpool_class *class_find(size_t size)
+{
+	unsigned i;
+
+	for (i=0; i<MBPOOL_CLASSES; i++) {
+
+		if (size <= pool.classv[i].size)
+			return &pool.classv[i];
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Allocate a buffer from the buffer pool. The buffer is returned with
+ * mbpool_put(), or freed with mem_deref().
+ *
+ * @param size Minimum size of the buffer
+ *
+ * @return New buffer, or NULL if out of memory
+ */
+struct mbuf *mbpool_alloc(size_t size)
+{
+	struct mbpool_class *c = class_find(size);
+	struct mbuf *mb;
+
+	if (c && c->n) {
+		mb = c->freev[--c->n];
+		pool.stats.bytes -= c->size;
+		++pool.stats.n_hit;
+
+		return mb;
+	}
+
+	++pool.stats.n_miss;
+
+	return mbuf_alloc(c ? c->size : size);
+}
+
+
+/**
+ * Return a buffer to the buffer pool. A buffer that is shared, or not
+ * of a class size, is released.
+ *
+ * @param mb Buffer
+ *
+ * @return Always NULL
+ */
+void *mbpool_put(struct mbuf *mb)
+{
+	struct mbpool_class *c;
+
+	if (!mb)
+		return NULL;
+
+	c = class_find(mb->size);
+
+	if (!c || c->size != mb->size ||
+	    c->n >= MBPOOL_CLASS_BYTES / c->size || c->n >= MBPOOL_FREE_MAX ||
+	    mem_nrefs(mb) > 1 || mem_nrefs(mb->buf) > 1) {
+
+		++pool.stats.n_drop;
+		mem_deref(mb);
+
+		return NULL;
+	}
+
+	mbuf_rewind(mb);
+
+	c->freev[c->n++] = mb;
+	pool.stats.bytes += c->size;
+	++pool.stats.n_put;
+
+	return NULL;
+}
+
+
+/**
+ * Free all buffers kept in the buffer pool. To be called at shutdown,
+ * before mem_debug(), and from the thread of the main loop.
+ */
+void mbpool_flush(void)
+{
+	unsigned i;
+
+	for (i=0; i<MBPOOL_CLASSES; i++) {
+
+		struct mbpool_class *c = &pool.classv[i];
+
+		while (c->n)
+			mem_deref(c->freev[--c->n]);
+	}
+
+	pool.stats.bytes = 0;
+}
+
+
+/**
+ * Get the statistics of the buffer pool
+ *
+ * @param stats Returned statistics
+ */
+void mbpool_stats_get(struct mbpool_stats *stats)
+{
+	if (!stats)
+		return;
+
+	*stats = pool.stats;
+}
+
+
+int mbpool_debug(struct re_printf *pf, void *unused)
+{
+	unsigned i;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "hit=%llu miss=%llu put=%llu dropped=%llu"
+			 " bytes=%zu free=",
+			 pool.stats.n_hit, pool.stats.n_miss,
+			 pool.stats.n_put, pool.stats.n_drop,
+			 pool.stats.bytes);
+
+	for (i=0; i<MBPOOL_CLASSES; i++) {
+
+		const struct mbpool_class *c = &pool.classv[i];
+
+		err |= re_hprintf(pf, "%s%zu:%u", i ? "," : "",
+				  c->size, c->n);
+	}
+
+	return err;
+}
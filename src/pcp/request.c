@@ -12,6 +12,7 @@
 #include <re_sys.h>
 #include <re_sa.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_udp.h>
 #include <re_pcp.h>
 #include "pcp.h"
@@ -29,9 +30,9 @@ struct pcp_request {
 	struct sa srv;
 	struct udp_sock *us;
 	struct mbuf *mb;
-	struct tmr tmr;
-	struct tmr tmr_dur;
-	struct tmr tmr_refresh;
+	struct tmrw_ent tmr;
+	struct tmrw_ent tmr_dur;
+	struct tmrw_ent tmr_refresh;
 	enum pcp_opcode opcode;
 	union pcp_payload payload;
 	uint32_t lifetime;
@@ -55,7 +56,8 @@ static const struct pcp_conf default_conf = {
 	3,
 	0,
 	1024,
-	0
+	0,
+	NULL
 };
 
 
@@ -94,9 +96,10 @@ static void destructor(void *arg)
 		(void)udp_send(req->us, &req->srv, req->mb);
 	}
 
-	tmr_cancel(&req->tmr);
-	tmr_cancel(&req->tmr_dur);
-	tmr_cancel(&req->tmr_refresh);
+	tmrw_cancel(&req->tmr);
+	tmrw_cancel(&req->tmr_dur);
+	tmrw_cancel(&req->tmr_refresh);
+	mem_deref(req->conf.tmrw);
 	mem_deref(req->us);
 	mem_deref(req->mb);
 }
@@ -107,8 +110,8 @@ static void completed(struct pcp_request *req, int err, struct pcp_msg *msg)
 	pcp_resp_h *resph = req->resph;
 	void *arg = req->arg;
 
-	tmr_cancel(&req->tmr);
-	tmr_cancel(&req->tmr_dur);
+	tmrw_cancel(&req->tmr);
+	tmrw_cancel(&req->tmr_dur);
 
 	/* if the request failed, we only called the
 	   response handler once and never again */
@@ -150,7 +153,7 @@ static void timeout(void *arg)
 	}
 
 	req->RT = RT_next(&req->conf, req->RT);
-	tmr_start(&req->tmr, req->RT * 1000, timeout, req);
+	tmrw_start(req->conf.tmrw, &req->tmr, req->RT * 1000, timeout, req);
 }
 
 
@@ -216,7 +219,8 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 
 		uint32_t v = req->lifetime * 3/4;
 
-		tmr_start(&req->tmr_refresh, v * 1000, refresh_timeout, req);
+		tmrw_start(req->conf.tmrw, &req->tmr_refresh, v * 1000,
+			   refresh_timeout, req);
 	}
 
 	completed(req, 0, msg);
@@ -238,11 +242,11 @@ static int start_sending(struct pcp_request *req)
 		return err;
 
 	req->RT = RT_init(&req->conf);
-	tmr_start(&req->tmr, req->RT * 1000, timeout, req);
+	tmrw_start(req->conf.tmrw, &req->tmr, req->RT * 1000, timeout, req);
 
 	if (req->conf.mrd) {
-		tmr_start(&req->tmr_dur, req->conf.mrd * 1000,
-			  timeout_duration, req);
+		tmrw_start(req->conf.tmrw, &req->tmr_dur,
+			   req->conf.mrd * 1000, timeout_duration, req);
 	}
 
 	return err;
@@ -270,6 +274,7 @@ static int pcp_vrequest(struct pcp_request **reqp, const struct pcp_conf *conf,
 		return ENOMEM;
 
 	req->conf   = conf ? *conf : default_conf;
+	mem_ref(req->conf.tmrw);
 	req->opcode = opcode;
 	req->srv    = *srv;
 	req->resph  = resph;
@@ -339,8 +344,9 @@ void pcp_force_refresh(struct pcp_request *req)
 	if (!req)
 		return;
 
-	tmr_cancel(&req->tmr);
-	tmr_cancel(&req->tmr_dur);
+	tmrw_cancel(&req->tmr);
+	tmrw_cancel(&req->tmr_dur);
 
-	tmr_start(&req->tmr_refresh, rand_u16() % 2000, refresh_timeout, req);
+	tmrw_start(req->conf.tmrw, &req->tmr_refresh, rand_u16() % 2000,
+		   refresh_timeout, req);
 }
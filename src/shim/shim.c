@@ -1,10 +1,12 @@
 
+#include <string.h>
 #include <re_types.h>
 #include <re_fmt.h>
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_tcp.h>
 #include <re_net.h>
+#include <re_mbpool.h>
 #include <re_shim.h>
 
 
@@ -13,15 +15,32 @@
 #include <re_dbg.h>
 
 
+enum {
+	SHIM_BUF_SIZE = 1024,  /* Smallest re-assembly buffer */
+	SHIM_FRAMEV_MAX = 32,  /* Max frames per call of the vector handler */
+};
+
+
 struct shim {
 	struct tcp_conn *tc;
 	struct tcp_helper *th;
 	struct mbuf *mb;
 	shim_frame_h *frameh;
+	shim_framev_h *framevh;
 	void *arg;
+	struct mbuf *framev[SHIM_FRAMEV_MAX];
+	size_t framec;
+	struct shim_conf conf;
+	size_t skip;
+	size_t scan;
+	bool paused;
+	bool inrecv;
 
 	uint64_t n_tx;
 	uint64_t n_rx;
+	uint64_t n_copy;
+	uint64_t n_oversize;
+	uint64_t n_overflow;
 };
 
 
@@ -35,7 +54,8 @@ static bool shim_send_handler(int *err, struct mbuf *mb, void *arg)
 	(void)shim;
 
 	if (mb->pos < SHIM_HDR_SIZE) {
-		DEBUG_WARNING("send: not enough space for SHIM header\n");
+		DEBUG_WARNING("send: not enough space for SHIM header"
+			      " (see shim_mbuf_alloc)\n");
 		*err = ENOMEM;
 		return true;
 	}
@@ -52,53 +72,200 @@ static bool shim_send_handler(int *err, struct mbuf *mb, void *arg)
 }
 
 
-static bool shim_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
-			      void *arg)
+/* frames are parsed in place, only an incomplete frame is copied */
+static int save_tail(struct shim *shim, const uint8_t *p, size_t n)
 {
-	struct shim *shim = arg;
-	int err = 0;
-	(void)estab;
+	int err;
+
+	if (!n)
+		return 0;
+
+	/* frames in the buffer are still held, or it is too small */
+	if (shim->mb && (mem_nrefs(shim->mb->buf) > 1 ||
+			 mbuf_get_left(shim->mb) + n > shim->mb->size)) {
+		struct mbuf *mb;
+		size_t left = mbuf_get_left(shim->mb);
+
+		mb = mbpool_alloc(max(left + n, SHIM_BUF_SIZE));
+		if (!mb)
+			return ENOMEM;
+
+		err = mbuf_write_mem(mb, mbuf_buf(shim->mb), left);
+		mb->pos = 0;
+		mbpool_put(shim->mb);
+		shim->mb = mb;
+		if (err)
+			return err;
+	}
 
-	/* handle re-assembly */
 	if (!shim->mb) {
-		shim->mb = mbuf_alloc(1024);
-		if (!shim->mb) {
-			*errp = ENOMEM;
-			return true;
-		}
+		shim->mb = mbpool_alloc(max(n, SHIM_BUF_SIZE));
+		if (!shim->mb)
+			return ENOMEM;
 	}
 
-	if (shim->mb) {
-		size_t pos;
+	/* compact, the buffer is kept for the next frames */
+	if (shim->mb->pos) {
+		size_t left = mbuf_get_left(shim->mb);
 
-		pos = shim->mb->pos;
+		memmove(shim->mb->buf, mbuf_buf(shim->mb), left);
+		shim->mb->pos = 0;
+		shim->mb->end = left;
+	}
 
-		shim->mb->pos = shim->mb->end;
+	shim->mb->pos = shim->mb->end;
+	err = mbuf_write_mem(shim->mb, p, n);
+	shim->mb->pos = 0;
 
-		err = mbuf_write_mem(shim->mb, mbuf_buf(mbx),
-				     mbuf_get_left(mbx));
-		if (err)
-			goto out;
+	shim->n_copy += n;
 
-		shim->mb->pos = pos;
-	}
+	return err;
+}
+
+
+static size_t frame_len(const struct mbuf *mb)
+{
+	uint16_t len;
+
+	memcpy(&len, mbuf_buf(mb), sizeof(len));
+
+	return ntohs(len);
+}
+
+
+/* bytes missing from the first frame in the re-assembly buffer */
+static size_t frame_missing(const struct mbuf *mb)
+{
+	size_t left = mbuf_get_left(mb);
+	size_t len;
+
+	if (left < SHIM_HDR_SIZE)
+		return SHIM_HDR_SIZE - left;
 
-	/* extract all SHIM-frames in the TCP-stream */
-	for (;;) {
+	len = SHIM_HDR_SIZE + frame_len(mb);
 
-		size_t start, len, pos, end;
+	return left < len ? len - left : 0;
+}
+
+
+/* the rest of a frame that is too large is dropped as it arrives */
+static void skip(struct shim *shim, struct mbuf *mbx)
+{
+	size_t n;
+
+	if (!mbx)
+		return;
+
+	n = min(shim->skip, mbuf_get_left(mbx));
+
+	mbx->pos   += n;
+	shim->skip -= n;
+}
+
+
+static void framev_flush(struct shim *shim)
+{
+	size_t i, n = shim->framec;
+
+	if (!n)
+		return;
+
+	shim->framec = 0;
+
+	shim->framevh(shim->framev, n, shim->arg);
+
+	for (i=0; i<n; i++)
+		shim->framev[i] = mem_deref(shim->framev[i]);
+}
+
+
+/* `mb' is a frame that was not handled, passed on as a view */
+static int framev_add(struct shim *shim, struct mbuf *mb)
+{
+	struct mbuf *view;
+
+	if (shim->framec == SHIM_FRAMEV_MAX)
+		framev_flush(shim);
+
+	view = mbuf_alloc_ref(mb);
+	if (!view)
+		return ENOMEM;
+
+	shim->framev[shim->framec++] = view;
+
+	return 0;
+}
+
+
+/* a drained buffer goes back to the pool, idle connections hold none */
+static void buf_drained(struct shim *shim)
+{
+	if (mbuf_get_left(shim->mb))
+		return;
+
+	shim->mb = mbpool_put(shim->mb);
+}
+
+
+/*
+ * Deliver the frames in the re-assembly buffer, completed from the
+ * segment `mbx', if any. A frame that is not handled is moved to the
+ * segment, to be passed on to the next receive handler.
+ */
+static int deliver_buf(struct shim *shim, struct mbuf *mbx, bool *passed)
+{
+	int err = 0;
+
+	while (shim->mb && mbuf_get_left(shim->mb) && !shim->paused) {
+
+		size_t pos, end, len, miss, left;
 		bool hdld;
 
-		start = shim->mb->pos;
+		left = mbuf_get_left(shim->mb);
 
-		if (mbuf_get_left(shim->mb) < (SHIM_HDR_SIZE))
-			break;
+		if (left >= SHIM_HDR_SIZE &&
+		    frame_len(shim->mb) > shim->conf.max_frame) {
 
-		len = ntohs(mbuf_read_u16(shim->mb));
+			len = SHIM_HDR_SIZE + frame_len(shim->mb);
+
+			++shim->n_oversize;
+
+			if (left >= len) {
+				shim->mb->pos += len;
+			}
+			else {
+				shim->mb->pos = shim->mb->end;
+				shim->skip = len - left;
+			}
+
+			buf_drained(shim);
+			skip(shim, mbx);
+			continue;
+		}
 
-		if (mbuf_get_left(shim->mb) < len)
-			goto rewind;
+		miss = frame_missing(shim->mb);
+		if (miss) {
+			size_t n;
+
+			if (!mbx)
+				break;
+
+			n = min(miss, mbuf_get_left(mbx));
+
+			err = save_tail(shim, mbuf_buf(mbx), n);
+			if (err)
+				break;
+
+			mbx->pos += n;
+
+			/* the segment is used up */
+			if (n < miss)
+				break;
+
+			continue;
+		}
 
+		len = ntohs(mbuf_read_u16(shim->mb));
 		pos = shim->mb->pos;
 		end = shim->mb->end;
 
@@ -107,44 +274,239 @@ static bool shim_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
 		++shim->n_rx;
 
 		hdld = shim->frameh(shim->mb, shim->arg);
-		if (!hdld) {
-			/* XXX: handle multiple frames per segment */
+		if (!hdld && shim->framevh) {
+			err = framev_add(shim, shim->mb);
+			hdld = true;
+		}
 
-			shim->mb->pos = pos;
-			shim->mb->end = pos + len;
+		shim->mb->pos = pos + len;
+		shim->mb->end = end;
 
-			mbx->pos = mbx->end = 2;
-			err = mbuf_write_mem(mbx, mbuf_buf(shim->mb), len);
+		if (err)
+			break;
+
+		if (!hdld && !mbx) {
+			DEBUG_NOTICE("resume: frame not handled (%zu bytes)\n",
+				     len);
+		}
+		else if (!hdld) {
+			/* without a vector handler, the next frames wait */
+
+			/* the segment is kept, and the frame moved to it */
+			shim->mb->pos = pos - SHIM_HDR_SIZE;
+
+			err = save_tail(shim, mbuf_buf(mbx),
+					mbuf_get_left(mbx));
 			if (err)
-				goto out;
-			mbx->pos = 2;
+				break;
+
+			pos = shim->mb->pos + SHIM_HDR_SIZE;
+
+			mbx->pos = mbx->end = SHIM_HDR_SIZE;
+			err = mbuf_write_mem(mbx, shim->mb->buf + pos, len);
+			if (err)
+				break;
+			mbx->pos = SHIM_HDR_SIZE;
 
 			shim->mb->pos = pos + len;
-			shim->mb->end = end;
 
-			return false;  /* continue recv-handlers */
+			buf_drained(shim);
+
+			*passed = true;
+			break;
+		}
+
+		buf_drained(shim);
+	}
+
+	return err;
+}
+
+
+/* a complete frame, or the header of one too large, is buffered */
+static bool buf_ready(const struct shim *shim)
+{
+	if (!shim->mb || mbuf_get_left(shim->mb) < SHIM_HDR_SIZE)
+		return false;
+
+	return frame_len(shim->mb) > shim->conf.max_frame ||
+		!frame_missing(shim->mb);
+}
+
+
+/*
+ * Deliver the buffered frames after a resume, also when the handlers
+ * of these frames pause and resume again.
+ */
+static int deliver_resumed(struct shim *shim)
+{
+	bool passed;
+	int err = 0;
+
+	while (!err && !shim->paused && buf_ready(shim)) {
+		err = deliver_buf(shim, NULL, &passed);
+		framev_flush(shim);
+	}
+
+	return err;
+}
+
+
+/*
+ * While paused, the frames that are too large are cut from the
+ * re-assembly buffer as they arrive, as they would be dropped on
+ * delivery. Only the frames to deliver count against the limit of
+ * buffered bytes. `scan' is the offset of the first frame not checked.
+ */
+static void strip_oversize(struct shim *shim)
+{
+	struct mbuf *mb = shim->mb;
+
+	while (mb && shim->scan + SHIM_HDR_SIZE <= mbuf_get_left(mb)) {
+
+		uint8_t *p = mbuf_buf(mb) + shim->scan;
+		size_t left = mbuf_get_left(mb) - shim->scan;
+		size_t len, n;
+		uint16_t v;
+
+		memcpy(&v, p, sizeof(v));
+		len = SHIM_HDR_SIZE + ntohs(v);
+
+		if (len - SHIM_HDR_SIZE <= shim->conf.max_frame) {
+
+			if (left < len)
+				break;
+
+			shim->scan += len;
+			continue;
 		}
 
-		shim->mb->pos = pos + len;
-		shim->mb->end = end;
+		++shim->n_oversize;
 
-		if (shim->mb->pos >= shim->mb->end) {
-			shim->mb = mem_deref(shim->mb);
+		/* the rest of the frame is dropped as it arrives */
+		n = min(len, left);
+		memmove(p, p + n, left - n);
+		mb->end -= n;
+		shim->skip = len - n;
+	}
+}
+
+
+static int check_quota(struct shim *shim)
+{
+	size_t n = shim_buffered(shim);
+
+	if (!shim->conf.max_buffered || n <= shim->conf.max_buffered)
+		return 0;
+
+	DEBUG_WARNING("%zu bytes buffered, over the limit of %zu\n",
+		      n, shim->conf.max_buffered);
+
+	++shim->n_overflow;
+
+	return ENOBUFS;
+}
+
+
+static bool shim_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
+			      void *arg)
+{
+	struct shim *shim = arg;
+	bool passed = false;
+	int err;
+	(void)estab;
+
+	skip(shim, mbx);
+
+	shim->inrecv = true;
+
+	/* first complete the frames of the previous segments */
+	err = deliver_buf(shim, mbx, &passed);
+	if (err || passed)
+		goto out;
+
+	/* then the frames of this segment, in place */
+	while (mbuf_get_left(mbx) >= SHIM_HDR_SIZE && !shim->paused) {
+
+		size_t start, pos, end, len;
+		bool hdld;
+
+		start = mbx->pos;
+		len   = ntohs(mbuf_read_u16(mbx));
+
+		if (len > shim->conf.max_frame) {
+			++shim->n_oversize;
+			shim->skip = len;
+			skip(shim, mbx);
+			continue;
+		}
+
+		if (mbuf_get_left(mbx) < len) {
+			mbx->pos = start;
 			break;
 		}
 
-		continue;
+		pos = mbx->pos;
+		end = mbx->end;
+
+		mbx->end = pos + len;
+
+		++shim->n_rx;
+
+		hdld = shim->frameh(mbx, shim->arg);
+		if (!hdld && shim->framevh) {
+			err = framev_add(shim, mbx);
+			if (err)
+				goto out;
+
+			hdld = true;
+		}
+
+		if (!hdld) {
+			/* without a vector handler, the next frames wait */
+
+			err = save_tail(shim, mbx->buf + pos + len,
+					end - pos - len);
+			if (err)
+				goto out;
+
+			mbx->pos = pos;
+			mbx->end = pos + len;
 
-	rewind:
-		shim->mb->pos = start;
-		break;
+			passed = true;
+			goto out;
+		}
+
+		mbx->pos = pos + len;
+		mbx->end = end;
 	}
 
+	/* all frames of the segment in one call */
+	framev_flush(shim);
+
+	/* an incomplete frame, or all frames while paused, wait */
+	err = save_tail(shim, mbuf_buf(mbx), mbuf_get_left(mbx));
+
  out:
+	framev_flush(shim);
+
+	/* resumed by the vector handler, after the loops ended */
+	if (!err && !passed)
+		err = deliver_resumed(shim);
+
+	if (!err && shim->paused)
+		strip_oversize(shim);
+
+	/* also when a frame is passed on, the rest is buffered */
+	if (!err)
+		err = check_quota(shim);
+
+	shim->inrecv = false;
+
 	if (err)
 		*errp = err;
 
-	return true;  /* always handled */
+	return !passed;  /* continue recv-handlers, if passed on */
 }
 
 
@@ -152,14 +514,31 @@ static void destructor(void *arg)
 {
 	struct shim *shim = arg;
 
+	size_t i;
+
+	for (i=0; i<shim->framec; i++)
+		mem_deref(shim->framev[i]);
+
 	mem_deref(shim->th);
 	mem_deref(shim->tc);
-	mem_deref(shim->mb);
+	mbpool_put(shim->mb);
 }
 
 
+/**
+ * Insert a SHIM helper (RFC 4571 framing) on a TCP connection
+ *
+ * @param shimp  Pointer to allocated SHIM object
+ * @param tc     TCP connection
+ * @param layer  Protocol stack layer
+ * @param conf   Limits, or NULL for no limits
+ * @param frameh Frame handler
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
 int shim_insert(struct shim **shimp, struct tcp_conn *tc, int layer,
-		shim_frame_h *frameh, void *arg)
+		const struct shim_conf *conf, shim_frame_h *frameh, void *arg)
 {
 	struct shim *shim;
 	int err;
@@ -181,6 +560,12 @@ int shim_insert(struct shim **shimp, struct tcp_conn *tc, int layer,
 	shim->frameh = frameh;
 	shim->arg = arg;
 
+	if (conf)
+		shim->conf = *conf;
+
+	if (!shim->conf.max_frame || shim->conf.max_frame > 0xffff)
+		shim->conf.max_frame = 0xffff;
+
  out:
 	if (err)
 		mem_deref(shim);
@@ -191,10 +576,192 @@ int shim_insert(struct shim **shimp, struct tcp_conn *tc, int layer,
 }
 
 
+/**
+ * Send frames on the TCP connection of a SHIM object. The frames are
+ * written with their headers into one buffer, and passed to the TCP
+ * connection with one send.
+ *
+ * @param shim SHIM object
+ * @param mbv  Frames, each from the current position to the end
+ * @param n    Number of frames
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shim_sendv(struct shim *shim, struct mbuf **mbv, size_t n)
+{
+	struct mbuf *mb;
+	size_t i, total = 0;
+	int err = 0;
+
+	if (!shim || !mbv)
+		return EINVAL;
+
+	for (i=0; i<n; i++) {
+
+		size_t len = mbuf_get_left(mbv[i]);
+
+		if (len > 0xffff)
+			return EOVERFLOW;
+
+		total += SHIM_HDR_SIZE + len;
+	}
+
+	if (!total)
+		return 0;
+
+	mb = mbuf_alloc(total);
+	if (!mb)
+		return ENOMEM;
+
+	for (i=0; i<n; i++) {
+
+		size_t len = mbuf_get_left(mbv[i]);
+
+		err |= mbuf_write_u16(mb, htons((uint16_t)len));
+		err |= mbuf_write_mem(mb, mbuf_buf(mbv[i]), len);
+	}
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+
+	/* the helpers below us, our own send handler is skipped */
+	err = tcp_send_helper(shim->tc, mb, shim->th);
+	if (err)
+		goto out;
+
+	shim->n_tx += n;
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/**
+ * Allocate a buffer with room for the SHIM header in front of the
+ * payload, so that it can be sent without moving the payload. The
+ * payload is written from the current position.
+ *
+ * @param size Size of the payload
+ *
+ * @return New buffer, or NULL if out of memory
+ */
+struct mbuf *shim_mbuf_alloc(size_t size)
+{
+	struct mbuf *mb;
+
+	mb = mbuf_alloc(SHIM_HDR_SIZE + size);
+	if (!mb)
+		return NULL;
+
+	mb->pos = SHIM_HDR_SIZE;
+	mb->end = SHIM_HDR_SIZE;
+
+	return mb;
+}
+
+
+/**
+ * Set a handler for the frames that the frame handler did not handle.
+ * All such frames of a TCP segment are passed in one call, in order,
+ * and none is held back until the next segment. Each mbuf is a view of
+ * one frame, and may be referenced beyond the call.
+ *
+ * The views share one buffer with the frames around them, so they are
+ * read-only. A handler that changes a frame must copy it first.
+ *
+ * @param shim    SHIM object
+ * @param framevh Frame vector handler, or NULL
+ */
+void shim_set_framev_handler(struct shim *shim, shim_framev_h *framevh)
+{
+	if (!shim)
+		return;
+
+	shim->framevh = framevh;
+}
+
+
+/**
+ * Pause the delivery of frames. The TCP connection is still read, and
+ * the frames are buffered up to the limit of buffered bytes, beyond
+ * which the connection is closed with ENOBUFS. Frames that are too
+ * large are dropped as they arrive, and do not count.
+ *
+ * This is not backpressure on the peer. libre cannot stop reading a
+ * TCP connection, so a peer that is not slowed down by other means
+ * fills the buffer, and the connection is closed.
+ *
+ * @param shim SHIM object
+ */
+void shim_pause(struct shim *shim)
+{
+	if (!shim)
+		return;
+
+	shim->paused = true;
+	shim->scan   = 0;
+}
+
+
+/**
+ * Resume the delivery of frames. The buffered frames are delivered
+ * right away, unless called from a frame handler. A frame that no
+ * handler takes is then dropped.
+ *
+ * @param shim SHIM object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shim_resume(struct shim *shim)
+{
+	int err;
+
+	if (!shim)
+		return EINVAL;
+
+	shim->paused = false;
+	shim->scan   = 0;
+
+	if (shim->inrecv)
+		return 0;
+
+	/* the handlers may pause again, or destroy the SHIM object */
+	mem_ref(shim);
+
+	shim->inrecv = true;
+	err = deliver_resumed(shim);
+	shim->inrecv = false;
+
+	mem_deref(shim);
+
+	return err;
+}
+
+
+/**
+ * Get the buffered bytes of frames not yet delivered
+ *
+ * @param shim SHIM object
+ *
+ * @return Number of buffered bytes
+ */
+size_t shim_buffered(const struct shim *shim)
+{
+	return shim && shim->mb ? mbuf_get_left(shim->mb) : 0;
+}
+
+
 int shim_debug(struct re_printf *pf, const struct shim *shim)
 {
 	if (!shim)
 		return 0;
 
-	return re_hprintf(pf, "tx=%llu, rx=%llu", shim->n_tx, shim->n_rx);
+	return re_hprintf(pf, "tx=%llu, rx=%llu, copied=%llu,"
+			  " oversize=%llu, overflow=%llu%s",
+			  shim->n_tx, shim->n_rx, shim->n_copy,
+			  shim->n_oversize, shim->n_overflow,
+			  shim->paused ? " (paused)" : "");
 }
@@ -0,0 +1,332 @@
+/**
+ * @file tmrw.c  Timer Wheel
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+
+
+/*
+ * A hashed timer wheel. Time is counted in ticks, and a timer is kept
+ * in the slot of its expiry tick, modulo the number of slots. Starting
+ * and cancelling a timer is O(1).
+ *
+ * The wheel has one timer on the main timer list, and wakes up only
+ * for the first slot that is in use, so timers that expire in the
+ * same tick share one wakeup. A timer fires within one tick after
+ * its expiry time.
+ *
+ * Without a wheel, a timer uses the main timer list, so modules can
+ * use the same code with or without a wheel.
+ */
+
+
+enum {
+	TMRW_SLOTS = 256,
+};
+
+
+/** Defines a timer wheel */
+struct tmrw {
+	struct tmr tmr;                   /**< Wakeup of the wheel          */
+	struct list slotv[TMRW_SLOTS];    /**< Timers, by expiry tick       */
+	uint32_t tick;                    /**< Tick length in [ms]          */
+	uint64_t cur;                     /**< Last processed tick          */
+	uint64_t wake;                    /**< Tick of next wakeup, 0=none  */
+	uint32_t n;                       /**< Number of running timers     */
+	uint64_t n_wakeup;                /**< Number of wakeups            */
+	uint64_t n_fire;                  /**< Number of fired timers       */
+};
+
+
+static void timeout(void *arg);
+
+
+static void destructor(void *arg)
+{
+	struct tmrw *w = arg;
+	unsigned i;
+
+	tmr_cancel(&w->tmr);
+
+	/* the timers may outlive the wheel */
+	for (i=0; i<TMRW_SLOTS; i++) {
+
+		struct le *le;
+
+		while ((le = list_head(&w->slotv[i]))) {
+			struct tmrw_ent *te = le->data;
+
+			list_unlink(&te->le);
+			te->w = NULL;
+		}
+	}
+}
+
+
+static void wakeup_at(struct tmrw *w, uint64_t t)
+{
+	uint64_t now = tmr_jiffies();
+	uint64_t at  = t * w->tick;
+
+	w->wake = t;
+	tmr_start(&w->tmr, at > now ? at - now : 0, timeout, w);
+}
+
+
+/* the first slot in use, after the current tick */
+static uint64_t next_tick(const struct tmrw *w)
+{
+	uint64_t t;
+
+	for (t = w->cur + 1; t <= w->cur + TMRW_SLOTS; t++) {
+
+		if (!list_isempty(&w->slotv[t & (TMRW_SLOTS - 1)]))
+			return t;
+	}
+
+	return 0;
+}
+
+
+static void timeout(void *arg)
+{
+	struct tmrw *w = arg;
+	uint64_t now = tmr_jiffies() / w->tick;
+	uint64_t t, next;
+	struct list due;
+	struct le *le;
+
+	list_init(&due);
+
+	++w->n_wakeup;
+	w->wake = 0;
+
+	/* visit each slot at most once */
+	t = w->cur + 1;
+	if (now > w->cur + TMRW_SLOTS)
+		t = now - TMRW_SLOTS + 1;
+
+	for (; t <= now; t++) {
+
+		le = list_head(&w->slotv[t & (TMRW_SLOTS - 1)]);
+		while (le) {
+			struct tmrw_ent *te = le->data;
+
+			le = le->next;
+
+			if (te->expires > now)
+				continue;
+
+			list_unlink(&te->le);
+			list_append(&due, &te->le, te);
+		}
+	}
+
+	if (now > w->cur)
+		w->cur = now;
+
+	/* a handler may release the last reference */
+	mem_ref(w);
+
+	/* a handler may cancel or restart other expired timers */
+	while ((le = list_head(&due))) {
+
+		struct tmrw_ent *te = le->data;
+		tmr_h *th = te->th;
+		void *tharg = te->arg;
+
+		list_unlink(&te->le);
+		te->w  = NULL;
+		te->th = NULL;
+		--w->n;
+		++w->n_fire;
+
+		if (th)
+			th(tharg);
+	}
+
+	next = w->n ? next_tick(w) : 0;
+	if (!next)
+		tmr_cancel(&w->tmr);
+	else if (!w->wake || next < w->wake)
+		wakeup_at(w, next);
+
+	mem_deref(w);
+}
+
+
+/**
+ * Allocate a timer wheel
+ *
+ * @param wp    Pointer to allocated timer wheel
+ * @param tick  Tick length in [ms], the resolution of the timers
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int tmrw_alloc(struct tmrw **wp, uint32_t tick)
+{
+	struct tmrw *w;
+	unsigned i;
+
+	if (!wp || !tick)
+		return EINVAL;
+
+	w = mem_zalloc(sizeof(*w), destructor);
+	if (!w)
+		return ENOMEM;
+
+	tmr_init(&w->tmr);
+
+	for (i=0; i<TMRW_SLOTS; i++)
+		list_init(&w->slotv[i]);
+
+	w->tick = tick;
+	w->cur  = tmr_jiffies() / tick;
+
+	*wp = w;
+
+	return 0;
+}
+
+
+/**
+ * Initialise a timer
+ *
+ * @param te Timer
+ */
+void tmrw_init(struct tmrw_ent *te)
+{
+	if (!te)
+		return;
+
+	memset(te, 0, sizeof(*te));
+	tmr_init(&te->tmr);
+}
+
+
+/**
+ * Start a timer, on a timer wheel or on the main timer list
+ *
+ * @param w     Timer wheel, or NULL to use the main timer list
+ * @param te    Timer
+ * @param delay Timeout in [ms]
+ * @param th    Timeout handler
+ * @param arg   Handler argument
+ */
+void tmrw_start(struct tmrw *w, struct tmrw_ent *te, uint64_t delay,
+		tmr_h *th, void *arg)
+{
+	uint64_t now;
+
+	if (!te)
+		return;
+
+	tmrw_cancel(te);
+
+	if (!w) {
+		tmr_start(&te->tmr, delay, th, arg);
+		return;
+	}
+
+	if (!th)
+		return;
+
+	now = tmr_jiffies();
+
+	/* an idle wheel has nothing to catch up on */
+	if (!w->n)
+		w->cur = max(w->cur, now / w->tick);
+
+	te->expires = (now + delay + w->tick - 1) / w->tick;
+	if (te->expires <= w->cur)
+		te->expires = w->cur + 1;
+
+	te->w   = w;
+	te->th  = th;
+	te->arg = arg;
+
+	list_append(&w->slotv[te->expires & (TMRW_SLOTS - 1)], &te->le, te);
+	++w->n;
+
+	if (!w->wake || te->expires < w->wake)
+		wakeup_at(w, te->expires);
+}
+
+
+/**
+ * Cancel a running timer
+ *
+ * @param te Timer
+ */
+void tmrw_cancel(struct tmrw_ent *te)
+{
+	if (!te)
+		return;
+
+	tmr_cancel(&te->tmr);
+
+	if (te->w) {
+		list_unlink(&te->le);
+		--te->w->n;
+		te->w = NULL;
+	}
+
+	te->th = NULL;
+}
+
+
+/**
+ * Check if a timer is running
+ *
+ * @param te Timer
+ *
+ * @return True if running, false if not running
+ */
+bool tmrw_isrunning(const struct tmrw_ent *te)
+{
+	if (!te)
+		return false;
+
+	return te->w != NULL || tmr_isrunning(&te->tmr);
+}
+
+
+/**
+ * Get the time left until a timer expires
+ *
+ * @param te Timer
+ *
+ * @return Time in [ms] until expiration
+ */
+uint64_t tmrw_get_expire(const struct tmrw_ent *te)
+{
+	uint64_t at, now;
+
+	if (!te)
+		return 0;
+
+	if (!te->w)
+		return tmr_get_expire(&te->tmr);
+
+	at  = te->expires * te->w->tick;
+	now = tmr_jiffies();
+
+	return at > now ? at - now : 0;
+}
+
+
+int tmrw_debug(struct re_printf *pf, const struct tmrw *w)
+{
+	if (!w)
+		return 0;
+
+	return re_hprintf(pf, "tick=%ums timers=%u wakeups=%llu fired=%llu",
+			  w->tick, w->n, w->n_wakeup, w->n_fire);
+}
@@ -9,7 +9,9 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_net.h>
 #include <re_sys.h>
@@ -67,6 +69,66 @@ enum ice_cand_type ice_cand_type_base(enum ice_cand_type type)
 }
 
 
+/** Hash key for candidate lookup, covering compid, proto and address */
+uint32_t trice_cand_hash(unsigned compid, int proto, const struct sa *addr)
+{
+	return sa_hash(addr, SA_ALL) ^ (uint32_t)compid << 16 ^
+		(uint32_t)proto;
+}
+
+
+static bool fnd_cmp_handler(struct le *le, void *arg)
+{
+	const struct trice_fnd *fnd = le->data;
+
+	return 0 == str_cmp(fnd->str, arg);
+}
+
+
+/**
+ * Intern a candidate foundation string, so that foundations can be
+ * compared as integers. Equal strings map to the same ID within one
+ * ICE Media object.
+ *
+ * @param icem ICE Media object
+ * @param idp  Pointer to the foundation ID
+ * @param fnd  Foundation string
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_fnd_intern(struct trice *icem, uint32_t *idp, const char *fnd)
+{
+	struct trice_fnd *f;
+	struct le *le;
+	uint32_t key;
+
+	if (!icem || !idp || !fnd)
+		return EINVAL;
+
+	key = hash_joaat_str(fnd);
+
+	le = hash_lookup(icem->fndh, key, fnd_cmp_handler, (void *)fnd);
+	if (le) {
+		f = le->data;
+		*idp = f->id;
+		return 0;
+	}
+
+	f = mem_zalloc(sizeof(*f), NULL);
+	if (!f)
+		return ENOMEM;
+
+	str_ncpy(f->str, fnd, sizeof(f->str));
+	f->id = ++icem->fndc;
+
+	hash_append(icem->fndh, key, &f->he, f);
+
+	*idp = f->id;
+
+	return 0;
+}
+
+
 int trice_cand_print(struct re_printf *pf, const struct ice_cand_attr *cand)
 {
 	int err = 0;
@@ -9,7 +9,9 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_udp.h>
 #include <re_stun.h>
@@ -45,25 +47,27 @@ static uint64_t ice_calc_pair_prio(uint32_t g, uint32_t d)
 }
 
 
-static void candpair_destructor(void *arg)
+/* Replace server reflexive candidates by its base */
+static const struct sa *cand_srflx_addr(const struct ice_lcand *cand)
 {
-	struct ice_candpair *cp = arg;
-
-	list_unlink(&cp->le);
-	mem_deref(cp->lcand);
-	mem_deref(cp->rcand);
-	mem_deref(cp->tc);
-
-	mem_deref(cp->conn);
+	if (ICE_CAND_TYPE_SRFLX == cand->attr.type)
+		return &cand->base_addr;
+	else
+		return &cand->attr.addr;
 }
 
 
-static bool sort_handler(struct le *le1, struct le *le2, void *arg)
+/*
+ * The pair hash is keyed on (compid, proto, base-address, remote-address),
+ * so a given (lcand, rcand) always maps to the same bucket as all
+ * the pairs that share its base.
+ */
+static uint32_t pair_hash(const struct ice_lcand *lcand,
+			  const struct ice_rcand *rcand)
 {
-	const struct ice_candpair *cp1 = le1->data, *cp2 = le2->data;
-	(void)arg;
-
-	return cp1->pprio >= cp2->pprio;
+	return trice_cand_hash(lcand->attr.compid, lcand->attr.proto,
+			       cand_srflx_addr(lcand)) ^
+		sa_hash(&rcand->attr.addr, SA_ALL);
 }
 
 
@@ -84,24 +88,102 @@ static void candpair_set_pprio(struct ice_candpair *cp, bool controlling)
 }
 
 
-/**
- * Add candidate pair to list, sorted by pair priority (highest is first)
- */
-static void list_add_sorted(struct list *list, struct ice_candpair *cp)
+static void bucket_unlink(struct ice_candpair *cp)
 {
+	/* pairl is the first member of the bucket */
+	struct trice_bucket *bucket = (struct trice_bucket *)cp->sle.list;
+
+	if (!bucket)
+		return;
+
+	--bucket->n;
+	trice_pairl_unlink(&cp->sle);
+}
+
+
+static void bucket_add(struct trice *icem, struct ice_candpair *cp)
+{
+	struct trice_bucket *bucket = &icem->statev[cp->state];
+
+	trice_pairl_insert(&bucket->pairl, &cp->sle, cp);
+	++bucket->n;
+}
+
+
+/* move the pair to the bucket of its new state */
+static void candpair_move(struct trice *icem, struct ice_candpair *cp,
+			  enum ice_candpair_state state)
+{
+	bucket_unlink(cp);
+	cp->state = state;
+	bucket_add(icem, cp);
+}
+
+
+static void fndgrp_destructor(void *arg)
+{
+	struct trice_fndgrp *grp = arg;
+
+	hash_unlink(&grp->he);
+}
+
+
+static bool fndgrp_cmp_handler(struct le *le, void *arg)
+{
+	const struct trice_fndgrp *grp = le->data;
+	const struct ice_candpair *cp = arg;
+
+	return grp->lfnd == cp->lcand->fndid && grp->rfnd == cp->rcand->fndid;
+}
+
+
+/* add the pair to the group of pairs with the same foundation */
+static int fndgrp_join(struct trice *icem, struct ice_candpair *cp)
+{
+	struct trice_fndgrp *grp;
 	struct le *le;
+	uint32_t key;
 
-	/* find our slot */
-	for (le = list_tail(list); le; le = le->prev) {
-		struct ice_candpair *cp0 = le->data;
+	key = cp->lcand->fndid << 16 ^ cp->rcand->fndid;
 
-		if (cp->pprio < cp0->pprio) {
-			list_insert_after(list, le, &cp->le, cp);
-			return;
-		}
+	le = hash_lookup(icem->fndgrph, key, fndgrp_cmp_handler, cp);
+	if (le) {
+		grp = mem_ref(le->data);
 	}
+	else {
+		grp = mem_zalloc(sizeof(*grp), fndgrp_destructor);
+		if (!grp)
+			return ENOMEM;
+
+		grp->lfnd = cp->lcand->fndid;
+		grp->rfnd = cp->rcand->fndid;
+		list_init(&grp->pairl);
+
+		hash_append(icem->fndgrph, key, &grp->he, grp);
+	}
+
+	list_append(&grp->pairl, &cp->fle, cp);
+	cp->grp = grp;
+
+	return 0;
+}
 
-	list_prepend(list, &cp->le, cp);
+
+static void candpair_destructor(void *arg)
+{
+	struct ice_candpair *cp = arg;
+
+	trice_pairl_unlink(&cp->le);
+	hash_unlink(&cp->he);
+	bucket_unlink(cp);
+	list_unlink(&cp->fle);
+	mem_deref(cp->grp);
+	mem_deref(cp->lcand);
+	mem_deref(cp->rcand);
+	mem_deref(cp->tc);
+
+	mem_deref(cp->conn);
+	mem_deref(cp->consent);
 }
 
 
@@ -109,6 +191,7 @@ int trice_candpair_alloc(struct ice_candpair **cpp, struct trice *icem,
 			struct ice_lcand *lcand, struct ice_rcand *rcand)
 {
 	struct ice_candpair *cp;
+	int err;
 
 	if (!icem || !lcand || !rcand)
 		return EINVAL;
@@ -128,7 +211,15 @@ int trice_candpair_alloc(struct ice_candpair **cpp, struct trice *icem,
 
 	candpair_set_pprio(cp, icem->lrole == ICE_ROLE_CONTROLLING);
 
-	list_add_sorted(&icem->checkl, cp);
+	err = fndgrp_join(icem, cp);
+	if (err) {
+		mem_deref(cp);
+		return err;
+	}
+
+	trice_pairl_insert(&icem->checkl, &cp->le, cp);
+	hash_append(icem->pairh, pair_hash(lcand, rcand), &cp->he, cp);
+	bucket_add(icem, cp);
 
 	if (cpp)
 		*cpp = cp;
@@ -137,18 +228,29 @@ int trice_candpair_alloc(struct ice_candpair **cpp, struct trice *icem,
 }
 
 
-/** Computing Pair Priority and Ordering Pairs */
-void trice_candpair_prio_order(struct list *lst, bool controlling)
+/**
+ * Computing Pair Priority and Ordering Pairs
+ *
+ * The candidate priorities are fixed, so a new role can only flip the
+ * tie-breaker bit of each pair priority and the lists are re-keyed
+ * in place instead of being sorted again.
+ */
+void trice_candpair_prio_order(struct trice *icem, bool controlling)
 {
 	struct le *le;
+	int i;
 
-	for (le = list_head(lst); le; le = le->next) {
-		struct ice_candpair *cp = le->data;
+	for (le = list_head(&icem->checkl.list); le; le = le->next)
+		candpair_set_pprio(le->data, controlling);
 
-		candpair_set_pprio(cp, controlling);
-	}
+	for (le = list_head(&icem->validl.list); le; le = le->next)
+		candpair_set_pprio(le->data, controlling);
 
-	list_sort(lst, sort_handler, NULL);
+	trice_pairl_rekey(&icem->checkl);
+	trice_pairl_rekey(&icem->validl);
+
+	for (i=0; i<TRICE_PAIR_STATES; i++)
+		trice_pairl_rekey(&icem->statev[i].pairl);
 }
 
 
@@ -166,16 +268,19 @@ void trice_candpair_make_valid(struct trice *icem, struct ice_candpair *pair)
 	pair->scode = 0;
 	pair->valid = true;
 
-	trice_candpair_set_state(pair, ICE_CANDPAIR_SUCCEEDED);
+	/* a valid pair may be checked again, e.g. for nomination */
+	if (pair->state != ICE_CANDPAIR_SUCCEEDED)
+		candpair_move(icem, pair, ICE_CANDPAIR_SUCCEEDED);
 
-	list_unlink(&pair->le);
-	list_add_sorted(&icem->validl, pair);
+	trice_pairl_unlink(&pair->le);
+	trice_pairl_insert(&icem->validl, &pair->le, pair);
 }
 
 
-void trice_candpair_failed(struct ice_candpair *cp, int err, uint16_t scode)
+void trice_candpair_failed(struct trice *icem, struct ice_candpair *cp,
+			   int err, uint16_t scode)
 {
-	if (!cp)
+	if (!icem || !cp)
 		return;
 
 	if (cp->state == ICE_CANDPAIR_SUCCEEDED) {
@@ -189,14 +294,14 @@ void trice_candpair_failed(struct ice_candpair *cp, int err, uint16_t scode)
 
 	cp->conn = mem_deref(cp->conn);
 
-	trice_candpair_set_state(cp, ICE_CANDPAIR_FAILED);
+	trice_candpair_set_state(icem, cp, ICE_CANDPAIR_FAILED);
 }
 
 
-void trice_candpair_set_state(struct ice_candpair *pair,
+void trice_candpair_set_state(struct trice *icem, struct ice_candpair *pair,
 			     enum ice_candpair_state state)
 {
-	if (!pair)
+	if (!icem || !pair)
 		return;
 	if (pair->state == state)
 		return;
@@ -209,13 +314,49 @@ void trice_candpair_set_state(struct ice_candpair *pair,
 	}
 
 #if 0
-	trice_printf(pair->lcand->icem,
+	trice_printf(icem,
 		    "%H new state \"%s\"\n",
 		    trice_candpair_debug, pair,
 		    trice_candpair_state2name(state));
 #endif
 
-	pair->state = state;
+	candpair_move(icem, pair, state);
+}
+
+
+/**
+ * Get the highest-priority candidate pair in a given state
+ *
+ * @param icem   ICE Media object
+ * @param state  Candidate pair state
+ *
+ * @return Candidate pair if found, otherwise NULL
+ */
+struct ice_candpair *trice_candpair_next(const struct trice *icem,
+					 enum ice_candpair_state state)
+{
+	if (!icem || state > ICE_CANDPAIR_FAILED)
+		return NULL;
+
+	return list_ledata(list_head(&icem->statev[state].pairl.list));
+}
+
+
+/**
+ * Get the number of candidate pairs in a given state
+ *
+ * @param icem   ICE Media object
+ * @param state  Candidate pair state
+ *
+ * @return Number of candidate pairs
+ */
+uint32_t trice_candpair_count(const struct trice *icem,
+			      enum ice_candpair_state state)
+{
+	if (!icem || state > ICE_CANDPAIR_FAILED)
+		return 0;
+
+	return icem->statev[state].n;
 }
 
 
@@ -233,6 +374,7 @@ bool trice_candpair_iscompleted(const struct ice_candpair *cp)
  * Find the highest-priority candidate-pair in a given list, with
  * optional match parameters
  *
+ * @param icem   ICE Media object
  * @param lst    List of candidate pairs
  * @param lcand  Local candidate (optional)
  * @param rcand  Remote candidate (optional)
@@ -241,12 +383,37 @@ bool trice_candpair_iscompleted(const struct ice_candpair *cp)
  *
  * note: assume list is sorted by priority
  */
-struct ice_candpair *trice_candpair_find(const struct list *lst,
+struct ice_candpair *trice_candpair_find(const struct trice *icem,
+					const struct list *lst,
 					const struct ice_lcand *lcand,
 					const struct ice_rcand *rcand)
 {
+	struct ice_candpair *best = NULL;
 	struct le *le;
 
+	/* fast path, both candidates are known */
+	if (icem && lcand && rcand) {
+
+		le = list_head(hash_list(icem->pairh,
+					 pair_hash(lcand, rcand)));
+
+		for (; le; le = le->next) {
+
+			struct ice_candpair *cp = le->data;
+
+			if (cp->lcand != lcand || cp->rcand != rcand)
+				continue;
+
+			if (cp->le.list != lst)
+				continue;
+
+			if (!best || cp->pprio > best->pprio)
+				best = cp;
+		}
+
+		return best;
+	}
+
 	for (le = list_head(lst); le; le = le->next) {
 
 		struct ice_candpair *cp = le->data;
@@ -295,10 +462,8 @@ bool trice_candpair_cmp_fnd(const struct ice_candpair *cp1,
 	if (!cp1 || !cp2)
 		return false;
 
-	return 0 == strcmp(cp1->lcand->attr.foundation,
-			   cp2->lcand->attr.foundation) &&
-		0 == strcmp(cp1->rcand->attr.foundation,
-			    cp2->rcand->attr.foundation);
+	return cp1->lcand->fndid == cp2->lcand->fndid &&
+		cp1->rcand->fndid == cp2->rcand->fndid;
 }
 
 
@@ -322,23 +487,16 @@ static bool tcptype_match(enum ice_tcptype loc, enum ice_tcptype rem)
 }
 
 
-/* Replace server reflexive candidates by its base */
-static const struct sa *cand_srflx_addr(const struct ice_lcand *cand)
-{
-	if (ICE_CAND_TYPE_SRFLX == cand->attr.type)
-		return &cand->base_addr;
-	else
-		return &cand->attr.addr;
-}
-
-
-static struct ice_candpair *find_same_base_list(const struct list *lst,
-						const struct ice_lcand *lcand,
-						const struct ice_rcand *rcand)
+/* the hash covers pairs in both check-list and valid-list */
+static struct ice_candpair *find_same_base(struct trice *icem,
+					   const struct ice_lcand *lcand,
+					   const struct ice_rcand *rcand)
 {
 	struct le *le;
 
-	for (le = list_head(lst); le; le = le->next) {
+	le = list_head(hash_list(icem->pairh, pair_hash(lcand, rcand)));
+
+	for (; le; le = le->next) {
 
 		struct ice_candpair *cp = le->data;
 
@@ -360,25 +518,6 @@ static struct ice_candpair *find_same_base_list(const struct list *lst,
 }
 
 
-/* look in both check-list and valid-list */
-static struct ice_candpair *find_same_base(struct trice *icem,
-					   const struct ice_lcand *lcand,
-					   const struct ice_rcand *rcand)
-{
-	struct ice_candpair *cp;
-
-	cp = find_same_base_list(&icem->checkl, lcand, rcand);
-	if (cp)
-		return cp;
-
-	cp = find_same_base_list(&icem->validl, lcand, rcand);
-	if (cp)
-		return cp;
-
-	return NULL;
-}
-
-
 /* Pair a candidate with all other candidates of the opposite kind */
 int trice_candpair_with_local(struct trice *icem, struct ice_lcand *lcand)
 {
@@ -483,6 +622,74 @@ int trice_candpair_with_remote(struct trice *icem, struct ice_rcand *rcand)
 }
 
 
+/**
+ * Select a valid candidate pair of a component
+ *
+ * With TRICE_SELECT_RTT, the pair with the lowest smoothed round-trip
+ * time is selected. A pair of higher priority is preferred, if its
+ * round-trip time is no more than the tolerance above the lowest.
+ * Pairs without a round-trip time come after all others.
+ *
+ * @param icem    ICE Media object
+ * @param compid  Component ID
+ * @param policy  Selection policy
+ * @param tol     Round-trip time tolerance in [ms]
+ *
+ * @return Selected candidate pair, or NULL if none is valid
+ */
+struct ice_candpair *trice_candpair_select(const struct trice *icem,
+					   unsigned compid,
+					   enum trice_select policy,
+					   uint32_t tol)
+{
+	struct ice_candpair *first = NULL;
+	bool measured = false;
+	uint64_t limit = 0;
+	struct le *le;
+
+	if (!icem)
+		return NULL;
+
+	/* the valid list is sorted by priority, highest first */
+	for (le = list_head(&icem->validl.list); le; le = le->next) {
+
+		struct ice_candpair *cp = le->data;
+
+		if (cp->lcand->attr.compid != compid)
+			continue;
+
+		if (!first)
+			first = cp;
+
+		if (policy != TRICE_SELECT_RTT)
+			break;
+
+		if (cp->rtt.n && (!measured || cp->rtt.srtt < limit)) {
+			limit = cp->rtt.srtt;
+			measured = true;
+		}
+	}
+
+	if (policy != TRICE_SELECT_RTT || !measured)
+		return first;
+
+	limit += (uint64_t)tol * 1000;
+
+	for (le = list_head(&icem->validl.list); le; le = le->next) {
+
+		struct ice_candpair *cp = le->data;
+
+		if (cp->lcand->attr.compid != compid)
+			continue;
+
+		if (cp->rtt.n && cp->rtt.srtt <= limit)
+			return cp;
+	}
+
+	return first;
+}
+
+
 int trice_candpair_debug(struct re_printf *pf, const struct ice_candpair *cp)
 {
 	int err;
@@ -506,6 +713,11 @@ int trice_candpair_debug(struct re_printf *pf, const struct ice_candpair *cp)
 	if (cp->scode)
 		err |= re_hprintf(pf, " [%u]", cp->scode);
 
+	if (cp->rtt.n) {
+		err |= re_hprintf(pf, " rtt=%u.%03ums",
+				  cp->rtt.srtt / 1000, cp->rtt.srtt % 1000);
+	}
+
 	return err;
 }
 
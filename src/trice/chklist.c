@@ -9,7 +9,9 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_stun.h>
 #include <re_ice.h>
@@ -26,26 +28,99 @@ static void destructor(void *arg)
 {
 	struct ice_checklist *ic = arg;
 
-	tmr_cancel(&ic->tmr_pace);
+	tmrw_cancel(&ic->tmr_pace);
+	trice_pacer_detach(ic);
 	list_flush(&ic->conncheckl);  /* flush before stun deref */
+	mem_deref(ic->ctransh);
 	mem_deref(ic->stun);
+	mem_deref(ic->pacer);
 }
 
 
+/*
+ * With a check burst, up to N checks for distinct pairs are sent per
+ * tick and the tick is N times longer, so the average rate stays at
+ * one check per interval (Ta).
+ */
 static void pace_timeout(void *arg)
 {
 	struct ice_checklist *ic = arg;
 	struct trice *icem = (struct trice *)ic->icem;
+	uint32_t burst = max(icem->conf.check_burst, 1);
+	uint32_t n = 0;
+
+	tmrw_start(icem->tmrw, &ic->tmr_pace, ic->interval * burst,
+		   pace_timeout, ic);
+
+	if (burst > 1)
+		trice_txbatch_cork(icem);
 
-	tmr_start(&ic->tmr_pace, ic->interval,
-		  pace_timeout, ic);
+	while (n < burst && trice_conncheck_schedule_check(icem))
+		++n;
 
-	trice_conncheck_schedule_check(icem);
+	if (burst > 1) {
+		trice_txbatch_flush(icem);
+
+		/* a short burst only uses its share of the time */
+		if (n < burst && tmrw_isrunning(&ic->tmr_pace)) {
+			tmrw_start(icem->tmrw, &ic->tmr_pace,
+				   ic->interval * max(n, 1), pace_timeout, ic);
+		}
+	}
 
 	trice_checklist_update(icem);
 }
 
 
+/* with a shared pacer, the pacer decides when to send the next check */
+static void pace_start(struct ice_checklist *ic, uint32_t delay)
+{
+	if (ic->pacer)
+		trice_pacer_attach(ic->pacer, ic);
+	else
+		tmrw_start(ic->icem->tmrw, &ic->tmr_pace, delay,
+			   pace_timeout, ic);
+}
+
+
+static void pace_stop(struct ice_checklist *ic)
+{
+	if (ic->pacer)
+		trice_pacer_detach(ic);
+	else
+		tmrw_cancel(&ic->tmr_pace);
+}
+
+
+static bool pace_isrunning(const struct ice_checklist *ic)
+{
+	if (ic->pacer)
+		return ic->ple.list != NULL;
+	else
+		return tmrw_isrunning(&ic->tmr_pace);
+}
+
+
+/**
+ * One tick of a shared pacer
+ *
+ * @param ic Checklist
+ *
+ * @return True if a check was sent, otherwise false
+ */
+bool trice_checklist_pace(struct ice_checklist *ic)
+{
+	struct trice *icem = ic->icem;
+	bool sent;
+
+	sent = trice_conncheck_schedule_check(icem);
+
+	trice_checklist_update(icem);
+
+	return sent;
+}
+
+
 int trice_checklist_start(struct trice *icem, struct stun *stun,
 			  uint32_t interval,
 			  trice_estab_h *estabh, trice_failed_h *failh,
@@ -65,8 +140,8 @@ int trice_checklist_start(struct trice *icem, struct stun *stun,
 	if (icem->checklist) {
 		ic = icem->checklist;
 
-		if (!tmr_isrunning(&ic->tmr_pace)) {
-			tmr_start(&ic->tmr_pace, 1, pace_timeout, ic);
+		if (!pace_isrunning(ic)) {
+			pace_start(ic, 1);
 		}
 		return 0;
 	}
@@ -95,16 +170,21 @@ int trice_checklist_start(struct trice *icem, struct stun *stun,
 
 	}
 
-	tmr_init(&ic->tmr_pace);
+	err = hash_alloc(&ic->ctransh, TRICE_CTRANS_HASH_SIZE);
+	if (err)
+		goto out;
+
+	tmrw_init(&ic->tmr_pace);
 
 	ic->interval = interval;
+	ic->pacer = mem_ref(icem->pacer);
 	ic->icem = icem;
 	ic->estabh = estabh;
 	ic->failh  = failh;
 	ic->arg    = arg;
 
 	ic->is_running = true;
-	tmr_start(&ic->tmr_pace, 0, pace_timeout, ic);
+	pace_start(ic, 0);
 
 	icem->checklist = ic;
 
@@ -126,7 +206,7 @@ void trice_checklist_stop(struct trice *icem)
 	ic = icem->checklist;
 
 	ic->is_running = false;
-	tmr_cancel(&ic->tmr_pace);
+	pace_stop(ic);
 }
 
 
@@ -135,34 +215,30 @@ void trice_checklist_stop(struct trice *icem)
  */
 bool trice_checklist_iscompleted(const struct trice *icem)
 {
-	struct le *le;
-
 	if (!icem)
 		return false;
 
-	for (le = icem->checkl.head; le; le = le->next) {
-
-		const struct ice_candpair *cp = le->data;
-
-		if (!trice_candpair_iscompleted(cp))
-			return false;
-	}
-
-	return true;
+	return trice_candpair_count(icem, ICE_CANDPAIR_FROZEN) == 0 &&
+		trice_candpair_count(icem, ICE_CANDPAIR_WAITING) == 0 &&
+		trice_candpair_count(icem, ICE_CANDPAIR_INPROGRESS) == 0;
 }
 
 
 /**
  * Scheduling Checks
+ *
+ * @param icem ICE Media object
+ *
+ * @return True if a check was scheduled, false if no pair was ready
  */
-void trice_conncheck_schedule_check(struct trice *icem)
+bool trice_conncheck_schedule_check(struct trice *icem)
 {
 	struct ice_candpair *pair;
 	bool use_cand;
 	int err = 0;
 
 	if (!icem)
-		return;
+		return false;
 
 	switch (icem->conf.nom) {
 
@@ -177,25 +253,25 @@ void trice_conncheck_schedule_check(struct trice *icem)
 	default:
 		DEBUG_WARNING("schedule_check: invalid nomination %d\n",
 			      icem->conf.nom);
-		return;
+		return false;
 	}
 
 	/* Find the highest priority pair in that check list that is in the
 	   Waiting state. */
-	pair = trice_candpair_find_state(&icem->checkl, ICE_CANDPAIR_WAITING);
+	pair = trice_candpair_next(icem, ICE_CANDPAIR_WAITING);
 	if (pair) {
 		err = trice_conncheck_send(icem, pair,
 					  use_cand);
 		if (err)
-			trice_candpair_failed(pair, err, 0);
-		return;
+			trice_candpair_failed(icem, pair, err, 0);
+		return true;
 	}
 
 	/* If there is no such pair: */
 
 	/* Find the highest priority pair in that check list that is in
 	   the Frozen state. */
-	pair = trice_candpair_find_state(&icem->checkl, ICE_CANDPAIR_FROZEN);
+	pair = trice_candpair_next(icem, ICE_CANDPAIR_FROZEN);
 	if (pair) { /* If there is such a pair: */
 
 		/* Unfreeze the pair.
@@ -204,13 +280,42 @@ void trice_conncheck_schedule_check(struct trice *icem)
 		err = trice_conncheck_send(icem, pair,
 					  use_cand);
 		if (err)
-			trice_candpair_failed(pair, err, 0);
-		return;
+			trice_candpair_failed(icem, pair, err, 0);
+		return true;
 	}
 
 	/* If there is no such pair: */
 
 	/* Terminate the timer for that check list. */
+	return false;
+}
+
+
+static bool unfreeze_handler(struct le *le, void *arg)
+{
+	const struct trice_fndgrp *grp = le->data;
+	struct trice *icem = arg;
+	struct ice_candpair *best = NULL;
+	struct le *le2;
+
+	for (le2 = grp->pairl.head; le2; le2 = le2->next) {
+
+		struct ice_candpair *cp = le2->data;
+
+		if (cp->state != ICE_CANDPAIR_FROZEN)
+			continue;
+
+		if (!best ||
+		    cp->lcand->attr.compid < best->lcand->attr.compid ||
+		    (cp->lcand->attr.compid == best->lcand->attr.compid &&
+		     cp->pprio > best->pprio))
+			best = cp;
+	}
+
+	if (best)
+		trice_candpair_set_state(icem, best, ICE_CANDPAIR_WAITING);
+
+	return false;
 }
 
 
@@ -219,8 +324,6 @@ void trice_conncheck_schedule_check(struct trice *icem)
  */
 void trice_checklist_set_waiting(struct trice *icem)
 {
-	struct le *le, *le2;
-
 	if (!icem)
 		return;
 
@@ -237,25 +340,7 @@ void trice_checklist_set_waiting(struct trice *icem)
 	used.
 	*/
 
-	for (le = icem->checkl.head; le; le = le->next) {
-
-		struct ice_candpair *cp = le->data;
-
-		for (le2 = icem->checkl.head; le2; le2 = le2->next) {
-
-			struct ice_candpair *cp2 = le2->data;
-
-			if (!trice_candpair_cmp_fnd(cp, cp2))
-				continue;
-
-			if (cp2->lcand->attr.compid < cp->lcand->attr.compid &&
-			    cp2->pprio > cp->pprio)
-				cp = cp2;
-		}
-
-		if (cp->state == ICE_CANDPAIR_FROZEN)
-			trice_candpair_set_state(cp, ICE_CANDPAIR_WAITING);
-	}
+	(void)hash_apply(icem->fndgrph, unfreeze_handler, icem);
 }
 
 
@@ -271,12 +356,12 @@ int trice_checklist_update(struct trice *icem)
 		return ENOSYS;
 
 	if (trice_checklist_iscompleted(icem)) {
-		tmr_cancel(&ic->tmr_pace);
+		pace_stop(ic);
 
 		trice_printf(icem, "ICE checklist is complete"
 			     " (checkl=%u, valid=%u)\n",
-			     list_count(&icem->checkl),
-			     list_count(&icem->validl));
+			     list_count(&icem->checkl.list),
+			     list_count(&icem->validl.list));
 	}
 
 	return 0;
@@ -292,7 +377,7 @@ void trice_checklist_refresh(struct trice *icem)
 
 	ic = icem->checklist;
 
-	tmr_start(&ic->tmr_pace, ic->interval, pace_timeout, ic);
+	pace_start(ic, ic->interval);
 }
 
 
@@ -318,8 +403,11 @@ int trice_checklist_debug(struct re_printf *pf, const struct ice_checklist *ic)
 		return 0;
 
 	err |= re_hprintf(pf, " Checklist: %s, interval=%ums\n",
-		  tmr_isrunning(&ic->tmr_pace) ? "Running" : "Not-Running",
+			  pace_isrunning(ic) ? "Running" : "Not-Running",
 			  ic->interval);
+	if (ic->pacer)
+		err |= re_hprintf(pf, " Pacer: %H\n", trice_pacer_debug,
+				  ic->pacer);
 	err |= re_hprintf(pf, " Pending connchecks: %u\n",
 			  list_count(&ic->conncheckl));
 	for (le = ic->conncheckl.head; le; le = le->next) {
@@ -9,10 +9,13 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_net.h>
 #include <re_stun.h>
+#include <re_sys.h>
 #include <re_ice.h>
 #include <re_trice.h>
 #include "trice.h"
@@ -26,13 +29,33 @@
 enum {PRESZ_RELAY = 36};
 
 
+/*
+ * The checks run as client transactions of their own, instead of on
+ * the STUN instance of the checklist. The retransmissions start with
+ * the timeout of the check and double up to the retransmission count
+ * of the STUN instance, and the wait after the last one is the timeout
+ * of the check times its multiplier, as in RFC 5389 section 7.2.1.
+ * The configuration of the STUN instance, which may be shared with the
+ * application, is only read.
+ */
+
+
+static void ctrans_stop(struct ice_conncheck *cc)
+{
+	tmrw_cancel(&cc->tmr);
+	hash_unlink(&cc->he);
+	cc->mb   = mem_deref(cc->mb);
+	cc->sock = mem_deref(cc->sock);
+}
+
+
 static void conncheck_destructor(void *arg)
 {
 	struct ice_conncheck *cc = arg;
 
 	cc->term = true;
 	list_unlink(&cc->le);
-	mem_deref(cc->ct_conn);
+	ctrans_stop(cc);
 }
 
 
@@ -72,6 +95,8 @@ static void pair_established(struct trice *icem, struct ice_candpair *pair,
 	if (!pair->estab) {
 		pair->estab = true;
 
+		trice_consent_auto(icem, pair);
+
 		if (icem->checklist->estabh) {
 			icem->checklist->estabh(pair, msg,
 						icem->checklist->arg);
@@ -149,9 +174,10 @@ static void handle_success(struct trice *icem, struct ice_candpair *pair,
 
 		lcand->us = mem_ref(pair->lcand->us);
 		pair_prflx->conn = mem_ref(pair->conn);
+		pair_prflx->rtt = pair->rtt;
 
 		/* mark the original HOST-one as failed */
-		trice_candpair_failed(pair, 0, 0);
+		trice_candpair_failed(icem, pair, 0, 0);
 
 		trice_candpair_make_valid(icem, pair_prflx);
 
@@ -159,7 +185,6 @@ static void handle_success(struct trice *icem, struct ice_candpair *pair,
 		return;
 	}
 
-	pair->state = ICE_CANDPAIR_FROZEN;
 	trice_candpair_make_valid(icem, pair);
 
 	/* Updating the Nominated Flag */
@@ -182,6 +207,40 @@ static int print_err(struct re_printf *pf, const int *err)
 }
 
 
+/*
+ * The STUN client retransmits a request with the same transaction ID,
+ * so a response that came after the first retransmission timeout of
+ * the check may belong to any of the transmissions.
+ *
+ * A sample of the first transmission goes to the pair, and to the
+ * local candidate, where it sets the timeout of the next checks.
+ *
+ * As in Karn's algorithm, an ambiguous sample is not used for the
+ * timeout. Instead the backed-off timeout is kept for the next checks
+ * of the local candidate, until one is answered before it expires.
+ * The pair takes the ambiguous sample as an upper bound, only if it
+ * has no sample yet.
+ */
+static void rtt_sample(struct ice_candpair *pair,
+		       const struct ice_conncheck *cc)
+{
+	struct ice_lcand *lcand = pair->lcand;
+	uint64_t rtt = tmr_jiffies() - cc->ts;
+
+	if (lcand->attr.proto != IPPROTO_UDP || rtt < cc->rto) {
+		trice_rtt_update(&pair->rtt, (uint32_t)rtt * 1000);
+		trice_rtt_update(&lcand->rtt, (uint32_t)rtt * 1000);
+		lcand->rto_backoff = 0;
+		return;
+	}
+
+	lcand->rto_backoff = trice_rtt_backoff(cc->rto, rtt);
+
+	if (!pair->rtt.n)
+		trice_rtt_update(&pair->rtt, (uint32_t)rtt * 1000);
+}
+
+
 static void stunc_resp_handler(int err, uint16_t scode, const char *reason,
 			       const struct stun_msg *msg, void *arg)
 {
@@ -212,7 +271,14 @@ static void stunc_resp_handler(int err, uint16_t scode, const char *reason,
 			     trice_cand_print, pair->rcand,
 			     err);
 
-		trice_candpair_failed(pair, err, scode);
+		/* Karn: the next checks wait longer */
+		if (err == ETIMEDOUT &&
+		    pair->lcand->attr.proto == IPPROTO_UDP) {
+			pair->lcand->rto_backoff =
+				trice_rtt_backoff(cc->rto, 0);
+		}
+
+		trice_candpair_failed(icem, pair, err, scode);
 		goto out;
 	}
 
@@ -222,10 +288,11 @@ static void stunc_resp_handler(int err, uint16_t scode, const char *reason,
 		attr = stun_msg_attr(msg, STUN_ATTR_XOR_MAPPED_ADDR);
 		if (!attr) {
 			DEBUG_WARNING("no XOR-MAPPED-ADDR in response\n");
-			trice_candpair_failed(pair, EPROTO, 0);
+			trice_candpair_failed(icem, pair, EPROTO, 0);
 			break;
 		}
 
+		rtt_sample(pair, cc);
 		handle_success(icem, pair, &attr->v.sa, msg, cc);
 		break;
 
@@ -235,7 +302,7 @@ static void stunc_resp_handler(int err, uint16_t scode, const char *reason,
 		break;
 
 	default:
-		trice_candpair_failed(pair, err, scode);
+		trice_candpair_failed(icem, pair, err, scode);
 		break;
 	}
 
@@ -249,6 +316,206 @@ static void stunc_resp_handler(int err, uint16_t scode, const char *reason,
 }
 
 
+static void ctrans_completed(struct ice_conncheck *cc, int err,
+			     uint16_t scode, const char *reason,
+			     const struct stun_msg *msg)
+{
+	ctrans_stop(cc);
+
+	stunc_resp_handler(err, scode, reason, msg, cc);
+}
+
+
+static void ctrans_timeout(void *arg)
+{
+	struct ice_conncheck *cc = arg;
+	const struct stun_conf *conf = stun_conf(cc->icem->checklist->stun);
+	int err;
+
+	if (cc->proto != IPPROTO_UDP || cc->txc++ >= conf->rc) {
+		ctrans_completed(cc, ETIMEDOUT, 0, NULL, NULL);
+		return;
+	}
+
+	cc->mb->pos = cc->pos;
+
+	err = stun_send(cc->proto, cc->sock, &cc->dst, cc->mb);
+	if (err) {
+		ctrans_completed(cc, err, 0, NULL, NULL);
+		return;
+	}
+
+	cc->ival = (cc->txc >= conf->rc) ? cc->rto * conf->rm : cc->ival * 2;
+
+	tmrw_start(cc->icem->tmrw, &cc->tmr, cc->ival, ctrans_timeout, cc);
+}
+
+
+static int ctrans_start(struct ice_checklist *ic, struct ice_conncheck *cc)
+{
+	const struct stun_conf *conf = stun_conf(ic->stun);
+	int err;
+
+	cc->mb->pos = cc->pos;
+
+	err = stun_send(cc->proto, cc->sock, &cc->dst, cc->mb);
+	if (err)
+		return err;
+
+	cc->txc  = 1;
+	cc->ival = cc->proto == IPPROTO_UDP ? cc->rto : conf->ti;
+
+	hash_append(ic->ctransh, hash_joaat(cc->tid, sizeof(cc->tid)),
+		    &cc->he, cc);
+
+	tmrw_start(ic->icem->tmrw, &cc->tmr, cc->ival, ctrans_timeout, cc);
+
+	return 0;
+}
+
+
+static bool tid_match_handler(struct le *le, void *arg)
+{
+	const struct ice_conncheck *cc = le->data;
+
+	return 0 == memcmp(cc->tid, arg, sizeof(cc->tid));
+}
+
+
+/**
+ * Handle a STUN response to a connectivity check
+ *
+ * @param icem  ICE Media object
+ * @param msg   STUN response
+ * @param ua    Unknown attributes of the response
+ * @param mb    Buffer with the encoded response
+ * @param start Start of the response in the buffer
+ *
+ * @return 0 if handled, ENOENT if no check is waiting for it,
+ *         otherwise the response is discarded
+ */
+int trice_conncheck_recv(struct trice *icem, const struct stun_msg *msg,
+			 const struct stun_unknown_attr *ua,
+			 struct mbuf *mb, size_t start)
+{
+	struct stun_errcode ec = {0, "OK"};
+	struct ice_conncheck *cc;
+	struct stun_attr *attr;
+	const uint8_t *tid;
+	int herr = 0, err;
+
+	if (!icem || !msg || !ua || !mb)
+		return EINVAL;
+
+	if (!icem->checklist)
+		return ENOENT;
+
+	tid = stun_msg_tid(msg);
+
+	cc = list_ledata(hash_lookup(icem->checklist->ctransh,
+				     hash_joaat(tid, STUN_TID_SIZE),
+				     tid_match_handler, (void *)tid));
+	if (!cc)
+		return ENOENT;
+
+	if (stun_msg_class(msg) == STUN_CLASS_ERROR_RESP) {
+
+		attr = stun_msg_attr(msg, STUN_ATTR_ERR_CODE);
+		if (attr)
+			ec = attr->v.err_code;
+		else
+			herr = EPROTO;
+	}
+
+	switch (ec.code) {
+
+	case 401:
+	case 438:
+		break;
+
+	default:
+		/* a forged response must not end the check */
+		err = trice_stun_chk_mi(icem->rhmac, mb, start);
+		if (err)
+			return err;
+		break;
+	}
+
+	if (!herr && ua->typec > 0)
+		herr = EPROTO;
+
+	ctrans_completed(cc, herr, ec.code, ec.reason, msg);
+
+	return 0;
+}
+
+
+/*
+ * USERNAME, PRIORITY and the role attribute of a check only change with
+ * the remote ufrag or the local role, so they are encoded once per local
+ * candidate. A check copies that template, patches in its transaction
+ * ID and USE-CANDIDATE, and appends MESSAGE-INTEGRITY and FINGERPRINT.
+ */
+static int lcand_template(struct trice *icem, struct ice_lcand *lcand,
+			  uint16_t ctrl_attr)
+{
+	static const uint8_t tid[STUN_TID_SIZE];
+	struct mbuf *mb;
+	int err;
+
+	if (lcand->chk_tmpl && lcand->chk_gen == icem->chk_gen)
+		return 0;
+
+	mb = mbuf_alloc(128);
+	if (!mb)
+		return ENOMEM;
+
+	err = stun_msg_encode(mb, STUN_METHOD_BINDING,
+			      STUN_CLASS_REQUEST, tid, NULL,
+			      NULL, 0, false, 0x00, 3,
+			      STUN_ATTR_USERNAME, icem->username,
+			      STUN_ATTR_PRIORITY, &lcand->prio_prflx,
+			      ctrl_attr, &icem->tiebrk);
+	if (err) {
+		mem_deref(mb);
+		return err;
+	}
+
+	mem_deref(lcand->chk_tmpl);
+	lcand->chk_tmpl = mb;
+	lcand->chk_gen  = icem->chk_gen;
+
+	return 0;
+}
+
+
+static int request_encode(struct mbuf *mb, struct trice *icem,
+			  const struct ice_lcand *lcand,
+			  const uint8_t *tid, bool use_cand)
+{
+	const struct mbuf *tmpl = lcand->chk_tmpl;
+	size_t start = mb->pos;
+	int err;
+
+	err = mbuf_write_mem(mb, tmpl->buf, tmpl->end);
+	if (err)
+		return err;
+
+	memcpy(mb->buf + start + STUN_HEADER_SIZE - STUN_TID_SIZE,
+	       tid, STUN_TID_SIZE);
+
+	if (use_cand) {
+		err |= mbuf_write_u16(mb, htons(STUN_ATTR_USE_CAND));
+		err |= mbuf_write_u16(mb, 0);
+	}
+
+	err |= trice_stun_append_mi(icem->rhmac, mb, start);
+	err |= trice_stun_append_fp(mb, start);
+
+	return err;
+}
+
+
 int trice_conncheck_stun_request(struct ice_checklist *ic,
 			       struct ice_conncheck *cc,
 			       struct ice_candpair *cp, void *sock,
@@ -256,8 +523,6 @@ int trice_conncheck_stun_request(struct ice_checklist *ic,
 {
 	struct ice_lcand *lcand = cp->lcand;
 	struct trice *icem = ic->icem;
-	char username_buf[64];
-	uint32_t prio_prflx;
 	uint16_t ctrl_attr;
 	bool use_cand = false;
 	size_t presz = 0;
@@ -275,26 +540,25 @@ int trice_conncheck_stun_request(struct ice_checklist *ic,
 	}
 
 	/* The password is equal to the password provided by the peer */
-	if (!str_isset(icem->rpwd)) {
+	if (!icem->rhmac) {
 		DEBUG_WARNING("conncheck: remote password missing for"
 			      " raddr=%J\n", &cp->rcand->attr.addr);
 		err = EINVAL;
 		goto out;
 	}
 
+	if (!icem->username) {
+		DEBUG_WARNING("conncheck: remote ufrag missing\n");
+		err = EINVAL;
+		goto out;
+	}
+
 	if (lcand->attr.proto == IPPROTO_UDP &&
 	    lcand->attr.type == ICE_CAND_TYPE_RELAY)
 		presz = PRESZ_RELAY;
 	else if (lcand->attr.proto == IPPROTO_TCP)
 		presz = 2;
 
-	(void)re_snprintf(username_buf, sizeof(username_buf),
-			  "%s:%s", icem->rufrag, icem->lufrag);
-
-	/* PRIORITY and USE-CANDIDATE */
-	prio_prflx = ice_cand_calc_prio(ICE_CAND_TYPE_PRFLX, 0,
-					lcand->attr.compid);
-
 	switch (icem->lrole) {
 
 	case ICE_ROLE_CONTROLLING:
@@ -322,19 +586,43 @@ int trice_conncheck_stun_request(struct ice_checklist *ic,
 	/* A connectivity check MUST utilize the STUN short term credential
 	   mechanism. */
 
-	err = stun_request(&cc->ct_conn, ic->stun, lcand->attr.proto,
-			   sock, &cp->rcand->attr.addr, presz,
-			   STUN_METHOD_BINDING,
-			   (uint8_t *)icem->rpwd, str_len(icem->rpwd),
-			   true, stunc_resp_handler, cc,
-			   4,
-			   STUN_ATTR_USERNAME, username_buf,
-			   STUN_ATTR_PRIORITY, &prio_prflx,
-			   ctrl_attr, &icem->tiebrk,
-			   STUN_ATTR_USE_CAND,
-			   use_cand ? &use_cand : 0);
+	/*
+	 * The first retransmission timeout of the check comes from the
+	 * local candidate, backed-off or from its round-trip time.
+	 */
+	ctrans_stop(cc);
+
+	cc->rto = lcand->rto_backoff ? lcand->rto_backoff
+		: trice_rtt_rto(&lcand->rtt, stun_conf(ic->stun)->rto);
+
+	cc->mb = mbuf_alloc(256);
+	if (!cc->mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	rand_bytes(cc->tid, sizeof(cc->tid));
+
+	cc->mb->pos = presz;
+	cc->mb->end = presz;
+	cc->pos     = presz;
+	cc->sock    = mem_ref(sock);
+	cc->dst     = cp->rcand->attr.addr;
+	cc->proto   = lcand->attr.proto;
+
+	err = lcand_template(icem, lcand, ctrl_attr);
+	if (err)
+		goto out;
+
+	err = request_encode(cc->mb, icem, lcand, cc->tid, use_cand);
+	if (err)
+		goto out;
+
+	cc->ts = tmr_jiffies();
+
+	err = ctrans_start(ic, cc);
 	if (err) {
-		DEBUG_NOTICE("stun_request from %H to %H failed (%m)\n",
+		DEBUG_NOTICE("conncheck from %H to %H failed (%m)\n",
 			      trice_cand_print, lcand,
 			      trice_cand_print, cp->rcand,
 			      err);
@@ -343,7 +631,8 @@ int trice_conncheck_stun_request(struct ice_checklist *ic,
 
  out:
 	if (err) {
-		trice_candpair_failed(cp, err, 0);
+		ctrans_stop(cc);
+		trice_candpair_failed(icem, cp, err, 0);
 	}
 
 	return err;
@@ -385,12 +674,15 @@ int trice_conncheck_send(struct trice *icem, struct ice_candpair *pair,
 	if (!cc)
 		return ENOMEM;
 
+	tmrw_init(&cc->tmr);
+
 	cc->icem = icem;
 	cc->pair = pair;
 	cc->use_cand = use_cand;
 
 	if (pair->state < ICE_CANDPAIR_INPROGRESS)
-		trice_candpair_set_state(pair, ICE_CANDPAIR_INPROGRESS);
+		trice_candpair_set_state(icem, pair,
+					 ICE_CANDPAIR_INPROGRESS);
 
 	switch (pair->lcand->attr.proto) {
 
@@ -447,7 +739,7 @@ int trice_conncheck_send(struct trice *icem, struct ice_candpair *pair,
 			   is established, we can then send our
 			   Connectivity-check */
 
-			trice_candpair_set_state(pair,
+			trice_candpair_set_state(icem, pair,
 						 ICE_CANDPAIR_INPROGRESS);
 			break;
 		}
@@ -463,7 +755,7 @@ int trice_conncheck_send(struct trice *icem, struct ice_candpair *pair,
  out:
 	if (err) {
 		mem_deref(cc);
-		trice_candpair_failed(pair, err, 0);
+		trice_candpair_failed(icem, pair, err, 0);
 	}
 
 	return err;
@@ -490,12 +782,15 @@ int trice_conncheck_trigged(struct trice *icem, struct ice_candpair *pair,
 	if (!cc)
 		return ENOMEM;
 
+	tmrw_init(&cc->tmr);
+
 	cc->icem = icem;
 	cc->pair = pair;
 	cc->use_cand = use_cand;
 
 	if (pair->state < ICE_CANDPAIR_INPROGRESS)
-		trice_candpair_set_state(pair, ICE_CANDPAIR_INPROGRESS);
+		trice_candpair_set_state(icem, pair,
+					 ICE_CANDPAIR_INPROGRESS);
 
 	err = trice_conncheck_stun_request(icem->checklist, cc,
 					 pair, sock, use_cand);
@@ -507,7 +802,7 @@ int trice_conncheck_trigged(struct trice *icem, struct ice_candpair *pair,
  out:
 	if (err) {
 		mem_deref(cc);
-		trice_candpair_failed(pair, err, 0);
+		trice_candpair_failed(icem, pair, err, 0);
 	}
 
 	return err;
@@ -519,10 +814,10 @@ int trice_conncheck_debug(struct re_printf *pf, const struct ice_conncheck *cc)
 	if (!cc)
 		return 0;
 
-	return re_hprintf(pf, "proto=%s stun=%p use_cand=%d"
+	return re_hprintf(pf, "proto=%s txc=%u use_cand=%d"
 			  " state=%s"
 			  ,
 			  net_proto2name(cc->pair->lcand->attr.proto),
-			  cc->ct_conn, cc->use_cand,
+			  cc->txc, cc->use_cand,
 			  trice_candpair_state2name(cc->pair->state));
 }
@@ -0,0 +1,354 @@
+/**
+ * @file consent.c  ICE Consent Freshness (RFC 7675)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_net.h>
+#include <re_stun.h>
+#include <re_sys.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+#define DEBUG_MODULE "consent"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * A Binding Request is sent on each pair with consent, at a random
+ * interval of 4 to 6 seconds. Consent expires 30 seconds after the
+ * last successful response, and the handler is called.
+ *
+ * The pairs are kept in one list, sorted by the time of their next
+ * check, so one timer serves all pairs of an ICE Media object.
+ */
+
+
+enum {
+	CONSENT_IVAL_MIN = 4000,     /* Check interval in [ms], lower bound */
+	CONSENT_IVAL_RND = 2000,     /* Random part of the check interval  */
+	CONSENT_EXPIRE   = 30000,    /* Consent lifetime in [ms]           */
+	PRESZ_RELAY      = 36,
+};
+
+
+/** Consent of one candidate pair */
+struct trice_consent {
+	struct le le;                /**< Element in consentl, by due time  */
+	struct ice_candpair *pair;   /**< Candidate pair, owner             */
+	struct trice *icem;          /**< ICE Media object                  */
+	struct stun_ctrans *ct;      /**< Pending consent check             */
+	uint64_t due;                /**< Time of the next check            */
+	uint64_t last;               /**< Time of the last consent          */
+};
+
+
+static void timeout(void *arg);
+
+
+static void consent_destructor(void *arg)
+{
+	struct trice_consent *c = arg;
+
+	list_unlink(&c->le);
+	mem_deref(c->ct);
+
+	if (c->pair)
+		c->pair->consent = NULL;
+}
+
+
+static void timer_update(struct trice *icem, uint64_t now)
+{
+	struct trice_consent *c = list_ledata(list_head(&icem->consentl));
+
+	if (!c) {
+		tmrw_cancel(&icem->tmr_consent);
+		return;
+	}
+
+	tmrw_start(icem->tmrw, &icem->tmr_consent,
+		   c->due > now ? c->due - now : 0, timeout, icem);
+}
+
+
+static void schedule(struct trice *icem, struct trice_consent *c,
+		     uint64_t due)
+{
+	struct le *le;
+
+	list_unlink(&c->le);
+	c->due = due;
+
+	/* most checks are due last, search from the end */
+	for (le = list_tail(&icem->consentl); le; le = le->prev) {
+
+		const struct trice_consent *x = le->data;
+
+		if (x->due <= due)
+			break;
+	}
+
+	if (le)
+		list_insert_after(&icem->consentl, le, &c->le, c);
+	else
+		list_prepend(&icem->consentl, &c->le, c);
+}
+
+
+static void stun_resp_handler(int err, uint16_t scode, const char *reason,
+			      const struct stun_msg *msg, void *arg)
+{
+	struct trice_consent *c = arg;
+	(void)msg;
+
+	if (err || scode) {
+		DEBUG_NOTICE("consent check failed: %H (%m %u %s)\n",
+			     trice_candpair_debug, c->pair,
+			     err, scode, reason);
+		return;
+	}
+
+	c->last = tmr_jiffies();
+}
+
+
+static int send_check(struct trice *icem, struct trice_consent *c)
+{
+	struct ice_candpair *pair = c->pair;
+	struct ice_lcand *lcand = pair->lcand;
+	uint16_t ctrl_attr;
+	size_t presz = 0;
+	void *sock;
+
+	switch (icem->lrole) {
+
+	case ICE_ROLE_CONTROLLING:
+		ctrl_attr = STUN_ATTR_CONTROLLING;
+		break;
+
+	case ICE_ROLE_CONTROLLED:
+		ctrl_attr = STUN_ATTR_CONTROLLED;
+		break;
+
+	default:
+		return EINVAL;
+	}
+
+	if (!icem->consent_stun || !icem->username || !icem->rpwd)
+		return EINVAL;
+
+	if (lcand->attr.proto == IPPROTO_TCP) {
+		sock  = pair->tc;
+		presz = 2;
+	}
+	else {
+		sock = trice_lcand_sock(icem, lcand);
+		if (lcand->attr.type == ICE_CAND_TYPE_RELAY)
+			presz = PRESZ_RELAY;
+	}
+
+	if (!sock)
+		return ENOTCONN;
+
+	/* a check still pending is not answered, and replaced */
+	c->ct = mem_deref(c->ct);
+
+	return stun_request(&c->ct, icem->consent_stun, lcand->attr.proto,
+			    sock, &pair->rcand->attr.addr, presz,
+			    STUN_METHOD_BINDING,
+			    (uint8_t *)icem->rpwd, str_len(icem->rpwd),
+			    true, stun_resp_handler, c,
+			    3,
+			    STUN_ATTR_USERNAME, icem->username,
+			    STUN_ATTR_PRIORITY, &lcand->prio_prflx,
+			    ctrl_attr, &icem->tiebrk);
+}
+
+
+static void timeout(void *arg)
+{
+	struct trice *icem = arg;
+	trice_consent_h *consenth = icem->consenth;
+	void *consent_arg = icem->consent_arg;
+	uint64_t now = tmr_jiffies();
+	struct list expl;
+	struct le *le;
+
+	list_init(&expl);
+
+	while ((le = list_head(&icem->consentl))) {
+
+		struct trice_consent *c = le->data;
+		int err;
+
+		if (c->due > now)
+			break;
+
+		if (now - c->last >= CONSENT_EXPIRE) {
+			list_unlink(&c->le);
+			list_append(&expl, &c->le, c);
+			continue;
+		}
+
+		err = send_check(icem, c);
+		if (err) {
+			DEBUG_NOTICE("consent check not sent: %H (%m)\n",
+				     trice_candpair_debug, c->pair, err);
+		}
+
+		schedule(icem, c, now + CONSENT_IVAL_MIN +
+			 rand_u32() % (CONSENT_IVAL_RND + 1));
+	}
+
+	timer_update(icem, now);
+
+	/*
+	 * The handler may remove pairs, or the ICE Media object. A pair
+	 * that goes away removes its consent from the expired list.
+	 */
+	while ((le = list_head(&expl))) {
+
+		struct trice_consent *c = le->data;
+		struct ice_candpair *pair = c->pair;
+
+		mem_deref(c);
+
+		if (consenth)
+			consenth(pair, ETIMEDOUT, consent_arg);
+	}
+}
+
+
+/**
+ * Set the handler for expired consent. With a handler, consent
+ * freshness is started on every nominated pair when it is valid.
+ *
+ * @param icem     ICE Media object
+ * @param consenth Consent expiry handler, or NULL
+ * @param arg      Handler argument
+ */
+void trice_set_consent_handler(struct trice *icem, trice_consent_h *consenth,
+			       void *arg)
+{
+	if (!icem)
+		return;
+
+	icem->consenth    = consenth;
+	icem->consent_arg = arg;
+}
+
+
+/**
+ * Start consent freshness on a valid candidate pair. An ICE-lite agent
+ * on a shared socket sends no checks, and has no consent freshness.
+ *
+ * @param icem ICE Media object
+ * @param pair Candidate pair
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_consent_start(struct trice *icem, struct ice_candpair *pair)
+{
+	struct trice_consent *c;
+	uint64_t now;
+
+	if (!icem || !pair)
+		return EINVAL;
+
+	if (pair->consent)
+		return 0;
+
+	if (!pair->valid)
+		return EINVAL;
+
+	if (icem->muxa)
+		return ENOTSUP;
+
+	/* keep the STUN Transport, the checklist may be stopped */
+	if (!icem->consent_stun) {
+
+		if (!icem->checklist)
+			return ENOENT;
+
+		icem->consent_stun = mem_ref(icem->checklist->stun);
+	}
+
+	c = mem_zalloc(sizeof(*c), consent_destructor);
+	if (!c)
+		return ENOMEM;
+
+	now = tmr_jiffies();
+
+	c->pair = pair;
+	c->icem = icem;
+	c->last = now;
+
+	pair->consent = c;
+
+	schedule(icem, c, now + CONSENT_IVAL_MIN +
+		 rand_u32() % (CONSENT_IVAL_RND + 1));
+	timer_update(icem, now);
+
+	return 0;
+}
+
+
+/**
+ * Stop consent freshness on a candidate pair
+ *
+ * @param pair Candidate pair
+ */
+void trice_consent_stop(struct ice_candpair *pair)
+{
+	struct trice *icem;
+
+	if (!pair || !pair->consent)
+		return;
+
+	icem = pair->consent->icem;
+
+	pair->consent = mem_deref(pair->consent);
+
+	timer_update(icem, tmr_jiffies());
+}
+
+
+void trice_consent_auto(struct trice *icem, struct ice_candpair *pair)
+{
+	int err;
+
+	if (!icem || !pair || !icem->consenth || icem->muxa)
+		return;
+
+	if (!pair->nominated || !pair->valid || pair->consent)
+		return;
+
+	err = trice_consent_start(icem, pair);
+	if (err) {
+		DEBUG_NOTICE("consent not started: %H (%m)\n",
+			     trice_candpair_debug, pair, err);
+	}
+}
+
+
+void trice_consent_flush(struct trice *icem)
+{
+	if (!icem)
+		return;
+
+	tmrw_cancel(&icem->tmr_consent);
+	list_flush(&icem->consentl);
+	icem->consent_stun = mem_deref(icem->consent_stun);
+}
@@ -9,7 +9,9 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_net.h>
 #include <re_sys.h>
@@ -64,10 +66,13 @@ static void lcand_destructor(void *arg)
 	struct ice_lcand *cand = arg;
 
 	list_unlink(&cand->le);
+	hash_unlink(&cand->he);
 
 	mem_deref(cand->ts);
+	mem_deref(cand->rxb);
 	mem_deref(cand->uh);
 	mem_deref(cand->us);
+	mem_deref(cand->chk_tmpl);
 }
 
 
@@ -110,7 +115,7 @@ int trice_add_lcandidate(struct ice_lcand **candp,
 	struct ice_lcand *cand;
 	int err = 0;
 
-	if (!lst || !compid || !proto || !addr)
+	if (!icem || !lst || !compid || !proto || !addr)
 		return EINVAL;
 
 	cand = mem_zalloc(sizeof(*cand), lcand_destructor);
@@ -133,6 +138,12 @@ int trice_add_lcandidate(struct ice_lcand **candp,
 	if (err)
 		goto out;
 
+	err = trice_fnd_intern(icem, &cand->fndid, cand->attr.foundation);
+	if (err)
+		goto out;
+
+	cand->prio_prflx = ice_cand_calc_prio(ICE_CAND_TYPE_PRFLX, 0, compid);
+
 	cand->icem = icem;
 
 	cand->recvh = trice_lcand_recv_handler;
@@ -142,6 +153,9 @@ int trice_add_lcandidate(struct ice_lcand **candp,
 		cand->base_addr = *base_addr;
 
 	list_append(lst, &cand->le, cand);
+	hash_append(icem->lcandh,
+		    trice_cand_hash(compid, proto, &cand->attr.addr),
+		    &cand->he, cand);
 
  out:
 	if (err)
@@ -153,17 +167,30 @@ int trice_add_lcandidate(struct ice_lcand **candp,
 }
 
 
-/* this one is only for Send statistics on Local Candidate */
+/* must be called when the address of the candidate has changed */
+static void lcand_rehash(struct trice *icem, struct ice_lcand *lcand)
+{
+	hash_unlink(&lcand->he);
+	hash_append(icem->lcandh,
+		    trice_cand_hash(lcand->attr.compid, lcand->attr.proto,
+				    &lcand->attr.addr),
+		    &lcand->he, lcand);
+}
+
+
+/* Send statistics on Local Candidate, and batching of checks */
 static bool udp_helper_send_handler(int *err, struct sa *dst,
 				    struct mbuf *mb, void *arg)
 {
 	struct ice_lcand *lcand = arg;
 	(void)err;
-	(void)dst;
-	(void)mb;
 
 	lcand->stats.n_tx += 1;
 
+	/* queued for a batched send */
+	if (trice_txbatch_queue(lcand, dst, mb))
+		return true;
+
 	return false;  /* NOT handled */
 }
 
@@ -344,6 +371,14 @@ int trice_lcand_add(struct ice_lcand **lcandp, struct trice *icem,
 						  lcand);
 			if (err)
 				goto out;
+
+			/* only for sockets that we own */
+			if (!sock && icem->conf.rx_batch) {
+				err = trice_rxbatch_alloc(&lcand->rxb, lcand,
+							  icem->conf.rx_batch);
+				if (err)
+					goto out;
+			}
 			break;
 
 		case IPPROTO_TCP:
@@ -403,6 +438,8 @@ int trice_lcand_add(struct ice_lcand **lcandp, struct trice *icem,
 			if (err)
 				goto out;
 
+			/* no batched receive, TURN is below the ICE layer */
+
 			break;
 
 		default:
@@ -430,6 +467,9 @@ int trice_lcand_add(struct ice_lcand **lcandp, struct trice *icem,
 		}
 	}
 
+	/* the port may have been assigned by the socket */
+	lcand_rehash(icem, lcand);
+
 	lcand->layer = layer;
 
 	if (icem->lrole != ICE_ROLE_UNKNOWN) {
@@ -453,6 +493,26 @@ int trice_lcand_add(struct ice_lcand **lcandp, struct trice *icem,
 }
 
 
+static bool lcand_match(const struct ice_cand_attr *cand,
+			enum ice_cand_type type, unsigned compid, int proto,
+			const struct sa *addr)
+{
+	if (type != (enum ice_cand_type)-1 && type != cand->type)
+		return false;
+
+	if (compid && cand->compid != compid)
+		return false;
+
+	if (cand->proto != proto)
+		return false;
+
+	if (addr && !sa_cmp(&cand->addr, addr, SA_ALL))
+		return false;
+
+	return true;
+}
+
+
 struct ice_lcand *trice_lcand_find(struct trice *icem,
 				   enum ice_cand_type type,
 				   unsigned compid, int proto,
@@ -469,25 +529,31 @@ struct ice_lcand *trice_lcand_find(struct trice *icem,
 		return NULL;
 	}
 
-	lst = &icem->lcandl;
+	/* fast path, all key fields are known */
+	if (compid && addr) {
 
-	for (le = list_head(lst); le; le = le->next) {
+		lst = hash_list(icem->lcandh,
+				trice_cand_hash(compid, proto, addr));
 
-		struct ice_cand_attr *cand = le->data;
+		for (le = list_head(lst); le; le = le->next) {
 
-		if (type != (enum ice_cand_type)-1 && type != cand->type)
-			continue;
+			struct ice_cand_attr *cand = le->data;
 
-		if (compid && cand->compid != compid)
-			continue;
+			if (lcand_match(cand, type, compid, proto, addr))
+				return (void *)cand;
+		}
 
-		if (cand->proto != proto)
-			continue;
+		return NULL;
+	}
 
-		if (addr && !sa_cmp(&cand->addr, addr, SA_ALL))
-			continue;
+	lst = &icem->lcandl;
 
-		return (void *)cand;
+	for (le = list_head(lst); le; le = le->next) {
+
+		struct ice_cand_attr *cand = le->data;
+
+		if (lcand_match(cand, type, compid, proto, addr))
+			return (void *)cand;
 	}
 
 	return NULL;
@@ -553,7 +619,27 @@ int trice_lcands_debug(struct re_printf *pf, const struct list *lst)
 					  &cand->attr.rel_addr);
 		}
 
-		err |= re_hprintf(pf, "\n");
+		err |= re_hprintf(pf, " [stun=%zu, dtls=%zu, rtp=%zu,"
+				  " other=%zu]\n",
+				  cand->stats.n_stun, cand->stats.n_dtls,
+				  cand->stats.n_rtp, cand->stats.n_other);
+
+		if (cand->rtt.n) {
+			err |= re_hprintf(pf, "      rtt=%u.%03ums rto=%ums\n",
+					  cand->rtt.srtt / 1000,
+					  cand->rtt.srtt % 1000,
+					  trice_rtt_rto(&cand->rtt, 0));
+		}
+
+		if (cand->rto_backoff) {
+			err |= re_hprintf(pf, "      rto backed off to %ums\n",
+					  cand->rto_backoff);
+		}
+
+		if (cand->rxb) {
+			err |= re_hprintf(pf, "      %H\n",
+					  trice_rxbatch_debug, cand);
+		}
 	}
 
 	return err;
@@ -8,8 +8,18 @@ SRCS	+= trice/cand.c
 SRCS	+= trice/candpair.c
 SRCS	+= trice/chklist.c
 SRCS	+= trice/connchk.c
+SRCS	+= trice/consent.c
 SRCS	+= trice/lcand.c
+SRCS	+= trice/mux.c
+SRCS	+= trice/pacer.c
+SRCS	+= trice/pairl.c
+SRCS	+= trice/ratelim.c
 SRCS	+= trice/rcand.c
+SRCS	+= trice/respcache.c
+SRCS	+= trice/rtt.c
+SRCS	+= trice/rxbatch.c
+SRCS	+= trice/stunmsg.c
 SRCS	+= trice/stunsrv.c
 SRCS	+= trice/tcpconn.c
 SRCS	+= trice/trice.c
+SRCS	+= trice/txbatch.c
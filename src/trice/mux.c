@@ -0,0 +1,728 @@
+/**
+ * @file mux.c  ICE-lite agents on a shared socket
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_hash.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_net.h>
+#include <re_stun.h>
+#include <re_udp.h>
+#include <re_tcp.h>
+#include <re_ice.h>
+#include <re_shim.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+#define DEBUG_MODULE "icemux"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * Many ICE-lite agents share one UDP socket and one TCP-passive
+ * socket. An incoming UDP packet is routed to its agent:
+ *
+ * - by the local ufrag in the USERNAME of a Binding Request, which is
+ *   read from the packet without decoding it.
+ *
+ * - otherwise by its source address, if a check from that source has
+ *   succeeded before. The local address and the protocol are the same
+ *   for all agents, so the source completes the 5-tuple.
+ *
+ * Other packets from an unknown source are dropped. A TCP connection
+ * is routed to the agent of the first check that succeeds on it. The
+ * connections not routed yet are limited in number, and closed if no
+ * check succeeds on them in time.
+ */
+
+
+enum {
+	MUX_SESS_MAX = 8,      /* Learned source addresses per agent */
+	MUX_TCP_BUF  = 131072, /* Buffered bytes per TCP connection  */
+	MUX_TCP_MAX  = 1024,   /* TCP connections, not routed yet    */
+	MUX_TCP_IDLE = 10000,  /* Routing timeout of TCP conns [ms]  */
+};
+
+
+/** A shared socket for many ICE-lite agents */
+struct trice_mux {
+	struct udp_sock *us;         /**< Shared UDP socket                  */
+	struct tcp_sock *ts;         /**< Shared TCP-passive socket, or NULL */
+	struct sa laddr;             /**< Local UDP address                  */
+	struct sa taddr;             /**< Local TCP address                  */
+	struct hash *ufragh;         /**< Agents, by local ufrag             */
+	struct hash *sessh;          /**< Sessions, by source address        */
+	struct list tconnl;          /**< TCP connections, not routed yet    */
+	struct mux_tconn *tconn_rx;  /**< TCP connection of the frame in use */
+	uint32_t natt;               /**< Number of agents                   */
+	uint32_t nsess;              /**< Number of sessions                 */
+	uint32_t ntconn;             /**< Number of TCP conns, not routed    */
+
+	struct {
+		uint64_t n_sess;     /**< Packets routed by source address   */
+		uint64_t n_ufrag;    /**< Packets routed by local ufrag      */
+		uint64_t n_drop;     /**< Packets with no route              */
+		uint64_t n_reject;   /**< TCP connections over the limit     */
+		uint64_t n_idle;     /**< TCP connections never routed       */
+	} stats;
+};
+
+
+/** An ICE Media object on a shared socket */
+struct trice_muxa {
+	struct le he;                /**< Element in ufragh                  */
+	struct trice_mux *mux;       /**< Shared socket                      */
+	struct trice *icem;          /**< ICE Media object, owner            */
+	struct ice_lcand *ulcand;    /**< UDP host candidate                 */
+	struct ice_lcand *tlcand;    /**< TCP-passive host candidate         */
+	struct list sessl;           /**< Sessions, least recent first       */
+	struct list tconnl;          /**< Routed TCP connections             */
+	uint32_t nsess;              /**< Number of sessions                 */
+	trice_mux_recv_h *recvh;     /**< Handler of non-STUN packets        */
+	void *arg;                   /**< Handler argument                   */
+};
+
+
+/** A source address with a successful check */
+struct mux_sess {
+	struct le he;                /**< Element in sessh                   */
+	struct le le;                /**< Element in sessl of the agent      */
+	struct trice_muxa *a;        /**< Agent                              */
+	struct sa src;               /**< Source address                     */
+};
+
+
+/** An accepted TCP connection */
+struct mux_tconn {
+	struct le le;                /**< Element in tconnl                  */
+	struct tmr tmr;              /**< Routing timeout                    */
+	struct trice_mux *mux;       /**< Shared socket                      */
+	struct trice_muxa *a;        /**< Agent, NULL until routed           */
+	struct tcp_conn *tc;         /**< TCP connection                     */
+	struct shim *shim;           /**< RFC 4571 framing                   */
+	struct sa paddr;             /**< Peer address                       */
+};
+
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return ntohs(v);
+}
+
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return ntohl(v);
+}
+
+
+/* the local ufrag of a Binding Request, read in place */
+static bool stun_lufrag(struct pl *lu, const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	size_t n = mbuf_get_left(mb);
+	size_t len, off = STUN_HEADER_SIZE;
+
+	/* a Binding Request has all class bits cleared */
+	if (n < STUN_HEADER_SIZE ||
+	    get_u16(p) != STUN_METHOD_BINDING ||
+	    get_u32(p + 4) != STUN_MAGIC_COOKIE)
+		return false;
+
+	len = STUN_HEADER_SIZE + get_u16(p + 2);
+	if (len > n)
+		return false;
+
+	while (off + STUN_ATTR_HEADER_SIZE <= len) {
+
+		uint16_t type = get_u16(p + off);
+		uint16_t alen = get_u16(p + off + 2);
+		const uint8_t *v = p + off + STUN_ATTR_HEADER_SIZE;
+		const uint8_t *colon;
+
+		if (off + STUN_ATTR_HEADER_SIZE + alen > len)
+			return false;
+
+		if (type != STUN_ATTR_USERNAME) {
+			off += STUN_ATTR_HEADER_SIZE + ((alen + 3) & ~3);
+			continue;
+		}
+
+		colon = memchr(v, ':', alen);
+		if (!colon || colon == v)
+			return false;
+
+		lu->p = (const char *)v;
+		lu->l = colon - v;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+static struct trice_muxa *ufrag_find(const struct trice_mux *mux,
+				     const char *ufrag, size_t len)
+{
+	struct le *le;
+
+	le = list_head(hash_list(mux->ufragh,
+				 hash_joaat((const uint8_t *)ufrag, len)));
+
+	for (; le; le = le->next) {
+
+		struct trice_muxa *a = le->data;
+		const struct trice *icem = a->icem;
+
+		if (icem->lufrag_len == len &&
+		    0 == memcmp(icem->lufrag, ufrag, len))
+			return a;
+	}
+
+	return NULL;
+}
+
+
+static struct mux_sess *sess_find(const struct trice_mux *mux,
+				  const struct sa *src)
+{
+	struct le *le;
+
+	le = list_head(hash_list(mux->sessh, sa_hash(src, SA_ALL)));
+
+	for (; le; le = le->next) {
+
+		struct mux_sess *s = le->data;
+
+		if (sa_cmp(&s->src, src, SA_ALL))
+			return s;
+	}
+
+	return NULL;
+}
+
+
+/* route a Binding Request by its local ufrag */
+static struct trice_muxa *route_ufrag(struct trice_mux *mux,
+				      const struct mbuf *mb)
+{
+	struct trice_muxa *a;
+	struct pl lu;
+
+	if (!stun_lufrag(&lu, mb))
+		return NULL;
+
+	a = ufrag_find(mux, lu.p, lu.l);
+	if (a)
+		++mux->stats.n_ufrag;
+
+	return a;
+}
+
+
+static void udp_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct trice_mux *mux = arg;
+	struct ice_lcand *lcand;
+	struct mux_sess *s = NULL;
+	struct trice_muxa *a;
+
+	/* a check may move its source to another agent */
+	a = route_ufrag(mux, mb);
+	if (!a) {
+		s = sess_find(mux, src);
+		if (!s)
+			goto drop;
+
+		a = s->a;
+		++mux->stats.n_sess;
+	}
+
+	lcand = a->ulcand;
+	lcand->stats.n_rx += 1;
+
+	if (lcand->recvh(lcand, IPPROTO_UDP, mux->us, src, mb, lcand->arg))
+		return;
+
+	/* other packets only from a source with a successful check */
+	if (!s)
+		goto drop;
+
+	if (a->recvh)
+		a->recvh(lcand, IPPROTO_UDP, mux->us, src, mb, a->arg);
+
+	return;
+
+ drop:
+	++mux->stats.n_drop;
+}
+
+
+/* the shared socket may outlive us, if a candidate still holds it */
+static void dummy_udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	(void)src;
+	(void)mb;
+	(void)arg;
+}
+
+
+static bool tconn_frame_handler(struct mbuf *mb, void *arg)
+{
+	struct mux_tconn *tconn = arg;
+	struct trice_mux *mux = tconn->mux;
+	struct trice_muxa *a = tconn->a;
+	struct ice_lcand *lcand;
+	bool routed = a != NULL;
+	bool hdld;
+
+	if (routed)
+		++mux->stats.n_sess;
+	else
+		a = route_ufrag(mux, mb);
+
+	if (!a || !a->tlcand)
+		goto drop;
+
+	lcand = a->tlcand;
+	lcand->stats.n_rx += 1;
+
+	/* a successful check routes this connection, see trice_mux_learn */
+	mux->tconn_rx = tconn;
+	hdld = lcand->recvh(lcand, IPPROTO_TCP, tconn->tc, &tconn->paddr, mb,
+			    lcand->arg);
+	mux->tconn_rx = NULL;
+
+	if (hdld)
+		return true;
+
+	if (!routed)
+		goto drop;
+
+	if (a->recvh) {
+		a->recvh(lcand, IPPROTO_TCP, tconn->tc, &tconn->paddr, mb,
+			 a->arg);
+	}
+
+	return true;
+
+ drop:
+	++mux->stats.n_drop;
+
+	return true;
+}
+
+
+static void tconn_destructor(void *arg)
+{
+	struct mux_tconn *tconn = arg;
+
+	tmr_cancel(&tconn->tmr);
+	list_unlink(&tconn->le);
+
+	if (!tconn->a)
+		--tconn->mux->ntconn;
+
+	if (tconn->mux->tconn_rx == tconn)
+		tconn->mux->tconn_rx = NULL;
+
+	/* note: helper must be closed before tc */
+	mem_deref(tconn->shim);
+	mem_deref(tconn->tc);
+}
+
+
+static void tcp_estab_handler(void *arg)
+{
+	struct mux_tconn *tconn = arg;
+	struct shim_conf conf = {0, MUX_TCP_BUF};
+	int err;
+
+	err = shim_insert(&tconn->shim, tconn->tc, 0, &conf,
+			  tconn_frame_handler, tconn);
+	if (err) {
+		DEBUG_WARNING("shim_insert [peer=%J] (%m)\n",
+			      &tconn->paddr, err);
+		mem_deref(tconn);
+	}
+}
+
+
+static void tcp_close_handler(int err, void *arg)
+{
+	struct mux_tconn *tconn = arg;
+	(void)err;
+
+	mem_deref(tconn);
+}
+
+
+/* no check has succeeded on the connection */
+static void tconn_idle_handler(void *arg)
+{
+	struct mux_tconn *tconn = arg;
+
+	++tconn->mux->stats.n_idle;
+
+	mem_deref(tconn);
+}
+
+
+static void tcp_conn_handler(const struct sa *peer, void *arg)
+{
+	struct trice_mux *mux = arg;
+	struct mux_tconn *tconn;
+	int err;
+
+	if (mux->ntconn >= MUX_TCP_MAX) {
+		++mux->stats.n_reject;
+		tcp_reject(mux->ts);
+		return;
+	}
+
+	tconn = mem_zalloc(sizeof(*tconn), tconn_destructor);
+	if (!tconn) {
+		tcp_reject(mux->ts);
+		return;
+	}
+
+	tconn->mux   = mux;
+	tconn->paddr = *peer;
+
+	list_append(&mux->tconnl, &tconn->le, tconn);
+	++mux->ntconn;
+
+	tmr_start(&tconn->tmr, MUX_TCP_IDLE, tconn_idle_handler, tconn);
+
+	err = tcp_accept(&tconn->tc, mux->ts, tcp_estab_handler,
+			 NULL, tcp_close_handler, tconn);
+	if (err) {
+		tcp_reject(mux->ts);
+		mem_deref(tconn);
+	}
+}
+
+
+static void mux_destructor(void *arg)
+{
+	struct trice_mux *mux = arg;
+
+	if (mux->us)
+		udp_handler_set(mux->us, dummy_udp_recv, NULL);
+
+	list_flush(&mux->tconnl);
+	hash_clear(mux->ufragh);
+	hash_clear(mux->sessh);
+	mem_deref(mux->ufragh);
+	mem_deref(mux->sessh);
+	mem_deref(mux->ts);
+	mem_deref(mux->us);
+}
+
+
+static void sess_destructor(void *arg)
+{
+	struct mux_sess *s = arg;
+
+	hash_unlink(&s->he);
+	list_unlink(&s->le);
+
+	--s->a->nsess;
+	--s->a->mux->nsess;
+}
+
+
+static void muxa_destructor(void *arg)
+{
+	struct trice_muxa *a = arg;
+
+	hash_unlink(&a->he);
+	list_flush(&a->sessl);
+	list_flush(&a->tconnl);
+
+	if (a->mux)
+		--a->mux->natt;
+
+	mem_deref(a->mux);
+}
+
+
+/**
+ * Allocate a shared socket for ICE-lite agents
+ *
+ * A TCP connection buffers at most 128 KiB of frames not delivered yet,
+ * and is closed beyond that. There is no backpressure on the peer,
+ * libre cannot stop reading a TCP connection.
+ *
+ * @param muxp  Pointer to allocated shared socket
+ * @param laddr Local address to listen on
+ * @param tcp   True to also listen for TCP connections on laddr
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_mux_alloc(struct trice_mux **muxp, const struct sa *laddr,
+		    bool tcp)
+{
+	struct trice_mux *mux;
+	int err;
+
+	if (!muxp || !sa_isset(laddr, SA_ADDR))
+		return EINVAL;
+
+	mux = mem_zalloc(sizeof(*mux), mux_destructor);
+	if (!mux)
+		return ENOMEM;
+
+	list_init(&mux->tconnl);
+
+	err  = hash_alloc(&mux->ufragh, TRICE_MUX_HASH_SIZE);
+	err |= hash_alloc(&mux->sessh, TRICE_MUX_HASH_SIZE);
+	if (err)
+		goto out;
+
+	err = udp_listen(&mux->us, laddr, udp_recv_handler, mux);
+	if (err)
+		goto out;
+
+	err = udp_local_get(mux->us, &mux->laddr);
+	if (err)
+		goto out;
+
+	if (tcp) {
+		err = tcp_listen(&mux->ts, laddr, tcp_conn_handler, mux);
+		if (err)
+			goto out;
+
+		err = tcp_local_get(mux->ts, &mux->taddr);
+		if (err)
+			goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(mux);
+	else
+		*muxp = mux;
+
+	return err;
+}
+
+
+/* a host candidate on the shared socket, without a socket of its own */
+static int lcand_add(struct ice_lcand **lcandp, struct trice *icem,
+		     unsigned compid, int proto, uint16_t lpref,
+		     const struct sa *addr, enum ice_tcptype tcptype)
+{
+	return trice_add_lcandidate(lcandp, icem, &icem->lcandl, compid,
+				    NULL, proto,
+				    ice_cand_calc_prio(ICE_CAND_TYPE_HOST,
+						       lpref, compid),
+				    addr, NULL, ICE_CAND_TYPE_HOST, NULL,
+				    tcptype);
+}
+
+
+/**
+ * Attach an ICE Media object to a shared socket, as an ICE-lite agent.
+ * The agent gets one host candidate per protocol of the shared socket,
+ * and is routed by its local ufrag, which must be unique.
+ *
+ * An ICE-lite agent sends no checks. It is controlled, and a pair is
+ * valid when it is nominated by the peer.
+ *
+ * @param mux    Shared socket
+ * @param icem   ICE Media object
+ * @param compid Component ID
+ * @param recvh  Handler of non-STUN packets from checked peers
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_mux_attach(struct trice_mux *mux, struct trice *icem,
+		     unsigned compid, trice_mux_recv_h *recvh, void *arg)
+{
+	struct trice_muxa *a;
+	int err;
+
+	if (!mux || !icem || !compid)
+		return EINVAL;
+
+	if (icem->muxa)
+		return EALREADY;
+
+	if (ufrag_find(mux, icem->lufrag, icem->lufrag_len))
+		return EADDRINUSE;
+
+	a = mem_zalloc(sizeof(*a), muxa_destructor);
+	if (!a)
+		return ENOMEM;
+
+	list_init(&a->sessl);
+	list_init(&a->tconnl);
+	a->mux   = mem_ref(mux);
+	a->icem  = icem;
+	a->recvh = recvh;
+	a->arg   = arg;
+	++mux->natt;
+
+	/* RFC 6544: UDP is preferred over TCP */
+	err = lcand_add(&a->ulcand, icem, compid, IPPROTO_UDP, 0xffff,
+			&mux->laddr, ICE_TCP_ACTIVE);
+	if (err)
+		goto out;
+
+	a->ulcand->us = mem_ref(mux->us);
+
+	if (mux->ts) {
+		err = lcand_add(&a->tlcand, icem, compid, IPPROTO_TCP,
+				0x7fff, &mux->taddr, ICE_TCP_PASSIVE);
+		if (err)
+			goto out;
+	}
+
+	hash_append(mux->ufragh,
+		    hash_joaat((const uint8_t *)icem->lufrag,
+			       icem->lufrag_len),
+		    &a->he, a);
+
+	icem->muxa = a;
+
+	/* the peers of an ICE-lite agent are learned from their checks */
+	icem->conf.enable_prflx = true;
+
+	if (icem->lrole == ICE_ROLE_UNKNOWN) {
+		err = trice_set_role(icem, ICE_ROLE_CONTROLLED);
+	}
+	else {
+		err = trice_candpair_with_local(icem, a->ulcand);
+		if (!err && a->tlcand)
+			err = trice_candpair_with_local(icem, a->tlcand);
+	}
+
+ out:
+	if (err) {
+		icem->muxa = NULL;
+		mem_deref(a->tlcand);
+		mem_deref(a->ulcand);
+		mem_deref(a);
+	}
+
+	return err;
+}
+
+
+/*
+ * Called after a successful check from `src', which routes the peer to
+ * this agent from now on. A source that moved from another agent is
+ * taken over.
+ */
+void trice_mux_learn(struct trice_muxa *a, void *sock, const struct sa *src)
+{
+	struct trice_mux *mux;
+	struct mux_tconn *tconn;
+	struct mux_sess *s;
+
+	if (!a || !sock || !src)
+		return;
+
+	mux = a->mux;
+
+	if (sock != mux->us) {
+
+		/* the connection of the frame with the check */
+		tconn = mux->tconn_rx;
+		if (!tconn || tconn->tc != sock || tconn->a)
+			return;
+
+		tmr_cancel(&tconn->tmr);
+		list_unlink(&tconn->le);
+		list_append(&a->tconnl, &tconn->le, tconn);
+		tconn->a = a;
+		--mux->ntconn;
+
+		return;
+	}
+
+	s = sess_find(mux, src);
+	if (s && s->a == a) {
+		list_unlink(&s->le);
+		list_append(&a->sessl, &s->le, s);
+		return;
+	}
+
+	mem_deref(s);
+
+	if (a->nsess >= MUX_SESS_MAX)
+		mem_deref(list_ledata(list_head(&a->sessl)));
+
+	s = mem_zalloc(sizeof(*s), sess_destructor);
+	if (!s)
+		return;
+
+	s->a   = a;
+	s->src = *src;
+
+	hash_append(mux->sessh, sa_hash(src, SA_ALL), &s->he, s);
+	list_append(&a->sessl, &s->le, s);
+	++a->nsess;
+	++mux->nsess;
+}
+
+
+int trice_muxa_debug(struct re_printf *pf, const struct trice_muxa *a)
+{
+	struct le *le;
+	int err;
+
+	if (!a)
+		return 0;
+
+	err = re_hprintf(pf, " Shared socket: ICE-lite, sessions=%u"
+			 " tcp=%u\n",
+			 a->nsess, list_count(&a->tconnl));
+
+	for (le = list_head(&a->sessl); le; le = le->next) {
+
+		const struct mux_sess *s = le->data;
+
+		err |= re_hprintf(pf, "      %J\n", &s->src);
+	}
+
+	return err;
+}
+
+
+int trice_mux_debug(struct re_printf *pf, const struct trice_mux *mux)
+{
+	if (!mux)
+		return 0;
+
+	return re_hprintf(pf, "udp=%J tcp=%J agents=%u sessions=%u"
+			  " tcp_unrouted=%u routed=%llu/%llu dropped=%llu"
+			  " tcp_rejected=%llu tcp_idle=%llu",
+			  &mux->laddr, &mux->taddr,
+			  mux->natt, mux->nsess, mux->ntconn,
+			  mux->stats.n_sess, mux->stats.n_ufrag,
+			  mux->stats.n_drop, mux->stats.n_reject,
+			  mux->stats.n_idle);
+}
@@ -0,0 +1,157 @@
+/**
+ * @file pacer.c  Shared pacing of ICE Connectivity Checks
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+/*
+ * RFC 8445 section 14 -- the pacing interval Ta applies to all ICE
+ * agents of an application. A shared pacer has one timer, and sends
+ * one check per interval, taking turns between the attached
+ * checklists. A checklist with no pair ready gives its turn to the
+ * next one.
+ */
+
+
+/** Defines a shared pacer */
+struct trice_pacer {
+	struct tmr tmr;              /**< Pacing timer                       */
+	struct list checkl;          /**< Attached checklists, in turn order */
+	uint32_t interval;           /**< Interval in [ms]                   */
+	uint32_t n;                  /**< Number of attached checklists      */
+	uint64_t n_check;            /**< Ticks with a check sent            */
+	uint64_t n_idle;             /**< Ticks with nothing to send         */
+};
+
+
+static void destructor(void *arg)
+{
+	struct trice_pacer *pacer = arg;
+
+	tmr_cancel(&pacer->tmr);
+	list_clear(&pacer->checkl);
+}
+
+
+static void timeout(void *arg)
+{
+	struct trice_pacer *pacer = arg;
+	uint32_t i, n = pacer->n;
+
+	tmr_start(&pacer->tmr, pacer->interval, timeout, pacer);
+
+	/* a checklist handler may release the last reference */
+	mem_ref(pacer);
+
+	for (i=0; i<n; i++) {
+
+		struct le *le = list_head(&pacer->checkl);
+		struct ice_checklist *ic;
+
+		if (!le)
+			break;
+
+		ic = le->data;
+
+		/* round-robin, move to the back of the line */
+		list_unlink(le);
+		list_append(&pacer->checkl, le, ic);
+
+		if (trice_checklist_pace(ic)) {
+			++pacer->n_check;
+			goto out;
+		}
+	}
+
+	++pacer->n_idle;
+
+ out:
+	if (list_isempty(&pacer->checkl))
+		tmr_cancel(&pacer->tmr);
+
+	mem_deref(pacer);
+}
+
+
+/**
+ * Allocate a shared pacer for connectivity checks
+ *
+ * @param pacerp   Pointer to allocated pacer
+ * @param interval Interval between checks, across all agents, in [ms]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_pacer_alloc(struct trice_pacer **pacerp, uint32_t interval)
+{
+	struct trice_pacer *pacer;
+
+	if (!pacerp || !interval)
+		return EINVAL;
+
+	pacer = mem_zalloc(sizeof(*pacer), destructor);
+	if (!pacer)
+		return ENOMEM;
+
+	tmr_init(&pacer->tmr);
+	list_init(&pacer->checkl);
+	pacer->interval = interval;
+
+	*pacerp = pacer;
+
+	return 0;
+}
+
+
+void trice_pacer_attach(struct trice_pacer *pacer, struct ice_checklist *ic)
+{
+	if (!pacer || !ic || ic->ple.list)
+		return;
+
+	list_append(&pacer->checkl, &ic->ple, ic);
+	++pacer->n;
+
+	if (!tmr_isrunning(&pacer->tmr))
+		tmr_start(&pacer->tmr, 0, timeout, pacer);
+}
+
+
+void trice_pacer_detach(struct ice_checklist *ic)
+{
+	struct trice_pacer *pacer;
+
+	if (!ic || !ic->pacer || !ic->ple.list)
+		return;
+
+	pacer = ic->pacer;
+
+	list_unlink(&ic->ple);
+	--pacer->n;
+
+	if (list_isempty(&pacer->checkl))
+		tmr_cancel(&pacer->tmr);
+}
+
+
+int trice_pacer_debug(struct re_printf *pf, const struct trice_pacer *pacer)
+{
+	if (!pacer)
+		return 0;
+
+	return re_hprintf(pf, "interval=%ums, checklists=%u,"
+			  " checks=%llu, idle=%llu",
+			  pacer->interval, pacer->n,
+			  pacer->n_check, pacer->n_idle);
+}
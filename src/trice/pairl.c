@@ -0,0 +1,311 @@
+/**
+ * @file pairl.c  Ordered list of ICE Candidate Pairs
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_sys.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+/*
+ * The pairs are kept in a plain list (level 0), so the list can be
+ * iterated as before. On top of that is a skiplist index, where about
+ * one in four list elements has a node of 1 or more levels.
+ *
+ * The list is sorted by pair priority, highest first. Pairs with equal
+ * priority are kept in insertion order, newest first.
+ */
+
+
+/** Skiplist node, indexing one list element */
+struct trice_skipn {
+	struct le *le;                              /**< Indexed element   */
+	struct trice_skipn *next[TRICE_SKIP_LEVELS]; /**< Next node/level  */
+};
+
+
+static inline uint64_t le_prio(const struct le *le)
+{
+	const struct ice_candpair *cp = le->data;
+
+	return cp->pprio;
+}
+
+
+static unsigned random_height(void)
+{
+	unsigned h = 0;
+
+	while (h < TRICE_SKIP_LEVELS && (rand_u32() & 3) == 0)
+		++h;
+
+	return h;
+}
+
+
+static struct trice_skipn *node_next(const struct trice_pairl *pl,
+				     const struct trice_skipn *n, unsigned i)
+{
+	return n ? n->next[i] : pl->headv[i];
+}
+
+
+static void node_set_next(struct trice_pairl *pl, struct trice_skipn *n,
+			  unsigned i, struct trice_skipn *next)
+{
+	if (n)
+		n->next[i] = next;
+	else
+		pl->headv[i] = next;
+}
+
+
+void trice_pairl_init(struct trice_pairl *pl)
+{
+	if (!pl)
+		return;
+
+	memset(pl, 0, sizeof(*pl));
+	list_init(&pl->list);
+}
+
+
+/**
+ * Insert a candidate pair, sorted by pair priority (highest is first)
+ *
+ * @param pl  Pair list
+ * @param le  List element of the pair
+ * @param cp  Candidate pair
+ */
+void trice_pairl_insert(struct trice_pairl *pl, struct le *le,
+			struct ice_candpair *cp)
+{
+	struct trice_skipn *updv[TRICE_SKIP_LEVELS];
+	struct trice_skipn *x = NULL, *n;
+	struct le *prev, *next;
+	unsigned i, h;
+
+	if (!pl || !le || !cp)
+		return;
+
+	memset(updv, 0, sizeof(updv));
+
+	/* find the last index node with a higher priority, per level */
+	for (i = pl->levels; i-- > 0;) {
+
+		for (n = node_next(pl, x, i); n; n = n->next[i]) {
+
+			if (le_prio(n->le) <= cp->pprio)
+				break;
+
+			x = n;
+		}
+
+		updv[i] = x;
+	}
+
+	/* then walk the remaining distance on the list itself */
+	prev = x ? x->le : NULL;
+	for (next = prev ? prev->next : pl->list.head; next;
+	     next = next->next) {
+
+		if (le_prio(next) <= cp->pprio)
+			break;
+
+		prev = next;
+	}
+
+	if (prev)
+		list_insert_after(&pl->list, prev, le, cp);
+	else
+		list_prepend(&pl->list, le, cp);
+
+	h = random_height();
+	if (!h)
+		return;
+
+	/* the index is only a shortcut, the list is correct without it */
+	n = mem_zalloc(sizeof(*n), NULL);
+	if (!n)
+		return;
+
+	n->le = le;
+
+	for (i=0; i<h; i++) {
+		n->next[i] = node_next(pl, updv[i], i);
+		node_set_next(pl, updv[i], i, n);
+	}
+
+	if (h > pl->levels)
+		pl->levels = h;
+}
+
+
+/**
+ * Unlink a candidate pair from its pair list
+ *
+ * @param le  List element of the pair
+ */
+void trice_pairl_unlink(struct le *le)
+{
+	struct trice_pairl *pl;
+	struct trice_skipn *x = NULL, *found = NULL;
+	uint64_t key;
+	unsigned i;
+
+	if (!le || !le->list)
+		return;
+
+	/* list is the first member of the pair list */
+	pl = (struct trice_pairl *)le->list;
+
+	/*
+	 * Search on the priority without the tie-breaker bit, so that
+	 * a run of pairs being re-keyed can be removed in any order.
+	 */
+	key = le_prio(le) >> 1;
+
+	for (i = pl->levels; i-- > 0;) {
+
+		struct trice_skipn *y, *n;
+
+		for (n = node_next(pl, x, i); n; n = n->next[i]) {
+
+			if (le_prio(n->le) >> 1 <= key)
+				break;
+
+			x = n;
+		}
+
+		y = x;
+		for (n = node_next(pl, y, i); n; n = n->next[i]) {
+
+			if (le_prio(n->le) >> 1 != key)
+				break;
+
+			if (n->le == le) {
+				node_set_next(pl, y, i, n->next[i]);
+				found = n;
+				break;
+			}
+
+			y = n;
+		}
+	}
+
+	while (pl->levels && !pl->headv[pl->levels - 1])
+		--pl->levels;
+
+	mem_deref(found);
+	list_unlink(le);
+}
+
+
+/**
+ * Restore the ordering after the priorities of the pairs have been
+ * recomputed for a new role. A role switch only flips the tie-breaker
+ * bit of the pair priority, so only runs of pairs that differ in that
+ * bit alone can change places.
+ *
+ * @param pl  Pair list
+ */
+void trice_pairl_rekey(struct trice_pairl *pl)
+{
+	struct le *le;
+
+	if (!pl)
+		return;
+
+	le = pl->list.head;
+	while (le) {
+
+		struct le *end = le->next;
+		struct list run;
+		uint64_t key = le_prio(le) >> 1;
+
+		while (end && le_prio(end) >> 1 == key)
+			end = end->next;
+
+		if (le->next == end) {
+			le = end;
+			continue;
+		}
+
+		list_init(&run);
+
+		while (le != end) {
+			struct le *next = le->next;
+
+			trice_pairl_unlink(le);
+			list_append(&run, le, le->data);
+
+			le = next;
+		}
+
+		while (run.head) {
+			struct le *rle = run.head;
+
+			list_unlink(rle);
+			trice_pairl_insert(pl, rle, rle->data);
+		}
+	}
+}
+
+
+static void index_flush(struct trice_pairl *pl)
+{
+	struct trice_skipn *n = pl->levels ? pl->headv[0] : NULL;
+
+	/* every index node is linked on the first level */
+	while (n) {
+		struct trice_skipn *next = n->next[0];
+
+		mem_deref(n);
+		n = next;
+	}
+
+	memset(pl->headv, 0, sizeof(pl->headv));
+	pl->levels = 0;
+}
+
+
+/**
+ * Flush a pair list, dereferencing all candidate pairs
+ *
+ * @param pl  Pair list
+ */
+void trice_pairl_flush(struct trice_pairl *pl)
+{
+	if (!pl)
+		return;
+
+	index_flush(pl);
+	list_flush(&pl->list);
+}
+
+
+/**
+ * Clear a pair list, without dereferencing the candidate pairs
+ *
+ * @param pl  Pair list
+ */
+void trice_pairl_clear(struct trice_pairl *pl)
+{
+	if (!pl)
+		return;
+
+	index_flush(pl);
+	list_clear(&pl->list);
+}
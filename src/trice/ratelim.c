@@ -0,0 +1,224 @@
+/**
+ * @file ratelim.c  Admission control of incoming STUN requests
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_hash.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+/*
+ * Each source address has a token bucket, holding up to "req_burst"
+ * tokens and refilled with "req_rate" tokens per second. A request
+ * takes one token, and is dropped without a response if there is
+ * none. This is checked before FINGERPRINT and MESSAGE-INTEGRITY, so
+ * a flood of bad requests costs neither hashing nor error responses.
+ *
+ * Tokens are counted in 1/1000, so that one millisecond adds exactly
+ * "req_rate" of them. A bucket that has been idle long enough to be
+ * full again is the same as a new one, and is removed.
+ *
+ * Only full buckets are removed, so a source cannot get a new bucket
+ * by waiting for its own to be pushed out. While all tracked sources
+ * have tokens taken, new sources share one bucket.
+ */
+
+
+enum {
+	RLIM_MAX  = 256,        /* Maximum number of tracked sources */
+	RLIM_UNIT = 1000,       /* Token units per request           */
+	RLIM_SCAN = 16,         /* Sources checked for a full bucket */
+};
+
+
+struct source {
+	struct le he;
+	struct le le;
+	struct sa addr;
+	uint64_t tokens;
+	uint64_t ts;
+};
+
+
+static void source_destructor(void *arg)
+{
+	struct source *s = arg;
+
+	hash_unlink(&s->he);
+	list_unlink(&s->le);
+}
+
+
+static bool source_cmp_handler(struct le *le, void *arg)
+{
+	const struct source *s = le->data;
+
+	return sa_cmp(&s->addr, arg, SA_ADDR);
+}
+
+
+static void source_remove(struct trice_ratelim *rl, struct source *s)
+{
+	--rl->n;
+	mem_deref(s);
+}
+
+
+/* refill a bucket, and take a token from it */
+static bool bucket_take(uint64_t *tokens, uint64_t *ts, uint64_t now,
+			uint64_t full, uint32_t rate)
+{
+	*tokens = min(*tokens + (now - *ts) * rate, full);
+	*ts     = now;
+
+	if (*tokens < RLIM_UNIT)
+		return false;
+
+	*tokens -= RLIM_UNIT;
+
+	return true;
+}
+
+
+/* drop sources with a full bucket, among the least recently used */
+static void expire(struct trice_ratelim *rl, uint64_t now, uint64_t full,
+		   uint32_t rate)
+{
+	struct le *le = rl->lru.tail;
+	unsigned i;
+
+	for (i=0; le && i<RLIM_SCAN; i++) {
+		struct source *s = le->data;
+
+		le = le->prev;
+
+		if (s->tokens + (now - s->ts) * rate >= full)
+			source_remove(rl, s);
+	}
+}
+
+
+int trice_ratelim_init(struct trice_ratelim *rl)
+{
+	if (!rl)
+		return EINVAL;
+
+	memset(rl, 0, sizeof(*rl));
+	list_init(&rl->lru);
+
+	return hash_alloc(&rl->ht, TRICE_RLIM_HASH_SIZE);
+}
+
+
+void trice_ratelim_flush(struct trice_ratelim *rl)
+{
+	if (!rl)
+		return;
+
+	list_flush(&rl->lru);
+	rl->n = 0;
+	rl->ht = mem_deref(rl->ht);
+}
+
+
+/**
+ * Take a token from the bucket of the source address of a request
+ *
+ * @param rl   Request limiter
+ * @param conf ICE configuration, with rate and burst
+ * @param src  Source address of the request
+ *
+ * @return True if the request is admitted, false to drop it
+ */
+bool trice_ratelim_admit(struct trice_ratelim *rl,
+			 const struct trice_conf *conf, const struct sa *src)
+{
+	struct source *s;
+	uint64_t now, full;
+	uint32_t rate;
+	bool ok;
+
+	if (!rl || !rl->ht || !conf || !src)
+		return true;
+
+	rate = conf->req_rate;
+	if (!rate)
+		return true;
+
+	full = (uint64_t)(conf->req_burst ? conf->req_burst : rate) *
+		RLIM_UNIT;
+	now  = tmr_jiffies();
+
+	s = list_ledata(hash_lookup(rl->ht, sa_hash(src, SA_ADDR),
+				    source_cmp_handler, (void *)src));
+	if (s) {
+		list_unlink(&s->le);
+		list_prepend(&rl->lru, &s->le, s);
+
+		ok = bucket_take(&s->tokens, &s->ts, now, full, rate);
+		goto out;
+	}
+
+	expire(rl, now, full, rate);
+
+	/* no bucket is full, new sources share one */
+	if (rl->n >= RLIM_MAX) {
+		++rl->n_shared;
+
+		ok = bucket_take(&rl->tokens, &rl->ts, now, full, rate);
+		goto out;
+	}
+
+	/* without memory for a bucket, let the request through */
+	s = mem_zalloc(sizeof(*s), source_destructor);
+	if (!s) {
+		ok = true;
+		goto out;
+	}
+
+	s->addr   = *src;
+	s->tokens = full;
+	s->ts     = now;
+
+	hash_append(rl->ht, sa_hash(src, SA_ADDR), &s->he, s);
+	list_prepend(&rl->lru, &s->le, s);
+	++rl->n;
+
+	ok = bucket_take(&s->tokens, &s->ts, now, full, rate);
+
+ out:
+	if (ok)
+		++rl->n_pass;
+	else
+		++rl->n_drop;
+
+	return ok;
+}
+
+
+int trice_ratelim_debug(struct re_printf *pf,
+			const struct trice_ratelim *rl,
+			const struct trice_conf *conf)
+{
+	if (!rl || !conf || !conf->req_rate)
+		return 0;
+
+	return re_hprintf(pf, " STUN Request limit: rate=%u/s burst=%u"
+			  " sources=%u passed=%llu dropped=%llu"
+			  " shared=%llu\n",
+			  conf->req_rate,
+			  conf->req_burst ? conf->req_burst : conf->req_rate,
+			  rl->n, rl->n_pass, rl->n_drop, rl->n_shared);
+}
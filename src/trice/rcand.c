@@ -9,7 +9,9 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_net.h>
 #include <re_stun.h>
@@ -28,11 +30,12 @@ static void rcand_destructor(void *data)
 	struct ice_rcand *cand = data;
 
 	list_unlink(&cand->le);
+	hash_unlink(&cand->he);
 }
 
 
 static int trice_add_rcandidate(struct ice_rcand **candp,
-			       struct list *lst,
+			       struct trice *icem,
 			       unsigned compid, const char *foundation,
 			       int proto,
 			       uint32_t prio, const struct sa *addr,
@@ -42,7 +45,7 @@ static int trice_add_rcandidate(struct ice_rcand **candp,
 	struct ice_rcand *cand;
 	int err = 0;
 
-	if (!lst || !compid || !foundation || !proto || !addr)
+	if (!icem || !compid || !foundation || !proto || !addr)
 		return EINVAL;
 
 	cand = mem_zalloc(sizeof(*cand), rcand_destructor);
@@ -58,10 +61,13 @@ static int trice_add_rcandidate(struct ice_rcand **candp,
 	cand->attr.type   = type;
 	cand->attr.tcptype = tcptype;
 
+	err = trice_fnd_intern(icem, &cand->fndid, cand->attr.foundation);
 	if (err)
 		goto out;
 
-	list_append(lst, &cand->le, cand);
+	list_append(&icem->rcandl, &cand->le, cand);
+	hash_append(icem->rcandh, trice_cand_hash(compid, proto, addr),
+		    &cand->he, cand);
 
  out:
 	if (err)
@@ -116,7 +122,7 @@ int trice_rcand_add(struct ice_rcand **rcandp, struct trice *icem,
 		goto out;
 	}
 
-	err = trice_add_rcandidate(&rcand, &icem->rcandl,
+	err = trice_add_rcandidate(&rcand, icem,
 				 compid, foundation,
 				 proto, prio, addr, type, tcptype);
 	if (err)
@@ -143,6 +149,22 @@ int trice_rcand_add(struct ice_rcand **rcandp, struct trice *icem,
 }
 
 
+static bool rcand_match(const struct ice_cand_attr *cand,
+			unsigned compid, int proto, const struct sa *addr)
+{
+	if (compid && cand->compid != compid)
+		return false;
+
+	if (cand->proto != proto)
+		return false;
+
+	if (addr && !sa_cmp(&cand->addr, addr, SA_ALL))
+		return false;
+
+	return true;
+}
+
+
 struct ice_rcand *trice_rcand_find(struct trice *icem,
 				   unsigned compid, int proto,
 				   const struct sa *addr)
@@ -158,22 +180,31 @@ struct ice_rcand *trice_rcand_find(struct trice *icem,
 		return NULL;
 	}
 
-	lst = &icem->rcandl;
+	/* fast path, all key fields are known */
+	if (compid && addr) {
 
-	for (le = list_head(lst); le; le = le->next) {
+		lst = hash_list(icem->rcandh,
+				trice_cand_hash(compid, proto, addr));
 
-		struct ice_cand_attr *cand = le->data;
+		for (le = list_head(lst); le; le = le->next) {
 
-		if (compid && cand->compid != compid)
-			continue;
+			struct ice_cand_attr *cand = le->data;
 
-		if (cand->proto != proto)
-			continue;
+			if (rcand_match(cand, compid, proto, addr))
+				return (void *)cand;
+		}
 
-		if (addr && !sa_cmp(&cand->addr, addr, SA_ALL))
-			continue;
+		return NULL;
+	}
+
+	lst = &icem->rcandl;
+
+	for (le = list_head(lst); le; le = le->next) {
+
+		struct ice_cand_attr *cand = le->data;
 
-		return (void *)cand;
+		if (rcand_match(cand, compid, proto, addr))
+			return (void *)cand;
 	}
 
 	return NULL;
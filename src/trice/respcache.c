@@ -0,0 +1,267 @@
+/**
+ * @file respcache.c  Response cache of the STUN server
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_hash.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+/*
+ * A peer retransmits a Binding Request with the same transaction ID
+ * until it gets a response. The encoded response to an authenticated
+ * request is kept for the lifetime of a STUN transaction, and sent
+ * again for a retransmission, without running the request handling
+ * a second time (RFC 5389 section 7.3.1).
+ *
+ * Entries are keyed by (local candidate, source, transaction ID). The
+ * least recently used entry is dropped when the cache is full.
+ */
+
+
+enum {
+	RESP_MAX = 64,          /* Maximum number of cached responses  */
+	RESP_AGE = 40000,       /* Lifetime in [ms], Ti is 39.5 seconds */
+};
+
+
+struct resp {
+	struct le he;
+	struct le le;
+	const struct ice_lcand *lcand;  /* not referenced, key only */
+	struct sa src;
+	uint8_t tid[STUN_TID_SIZE];
+	uint64_t ts;
+	struct mbuf *mb;
+};
+
+
+static void resp_destructor(void *arg)
+{
+	struct resp *r = arg;
+
+	hash_unlink(&r->he);
+	list_unlink(&r->le);
+	mem_deref(r->mb);
+}
+
+
+static uint32_t tid_hash(const uint8_t *tid)
+{
+	uint32_t h;
+
+	/* the transaction ID is random, any 32 bits of it will do */
+	memcpy(&h, tid, sizeof(h));
+
+	return h;
+}
+
+
+static struct resp *resp_find(const struct trice_respcache *rc,
+			      const struct ice_lcand *lcand,
+			      const struct sa *src, const uint8_t *tid)
+{
+	struct le *le;
+
+	le = list_head(hash_list(rc->ht, tid_hash(tid)));
+	for (; le; le = le->next) {
+
+		struct resp *r = le->data;
+
+		if (r->lcand != lcand)
+			continue;
+
+		if (memcmp(r->tid, tid, STUN_TID_SIZE))
+			continue;
+
+		if (!sa_cmp(&r->src, src, SA_ALL))
+			continue;
+
+		return r;
+	}
+
+	return NULL;
+}
+
+
+static void resp_remove(struct trice_respcache *rc, struct resp *r)
+{
+	--rc->n;
+	mem_deref(r);
+}
+
+
+/* drop expired entries, oldest first */
+static void expire(struct trice_respcache *rc, uint64_t now)
+{
+	struct le *le = rc->lru.tail;
+
+	while (le) {
+		struct resp *r = le->data;
+
+		le = le->prev;
+
+		if (now - r->ts < RESP_AGE)
+			break;
+
+		resp_remove(rc, r);
+	}
+}
+
+
+int trice_respcache_init(struct trice_respcache *rc)
+{
+	if (!rc)
+		return EINVAL;
+
+	list_init(&rc->lru);
+	rc->n = 0;
+	rc->n_replay = 0;
+
+	return hash_alloc(&rc->ht, TRICE_RESP_HASH_SIZE);
+}
+
+
+void trice_respcache_flush(struct trice_respcache *rc)
+{
+	if (!rc)
+		return;
+
+	list_flush(&rc->lru);
+	rc->n = 0;
+	rc->ht = mem_deref(rc->ht);
+}
+
+
+/**
+ * Add the encoded response to a request, replacing an older one
+ *
+ * @param rc    Response cache
+ * @param lcand Local candidate that received the request
+ * @param src   Source address of the request
+ * @param tid   Transaction ID of the request
+ * @param buf   Encoded STUN response, without preamble
+ * @param len   Length of the response
+ */
+void trice_respcache_add(struct trice_respcache *rc,
+			 const struct ice_lcand *lcand, const struct sa *src,
+			 const uint8_t *tid, const uint8_t *buf, size_t len)
+{
+	struct resp *r;
+	uint64_t now;
+
+	if (!rc || !rc->ht || !lcand || !src || !tid || !buf)
+		return;
+
+	now = tmr_jiffies();
+
+	expire(rc, now);
+
+	r = resp_find(rc, lcand, src, tid);
+	if (r)
+		resp_remove(rc, r);
+	else if (rc->n >= RESP_MAX)
+		resp_remove(rc, rc->lru.tail->data);
+
+	/* the cache is an optimization, failing to add is not an error */
+	r = mem_zalloc(sizeof(*r), resp_destructor);
+	if (!r)
+		return;
+
+	r->mb = mbuf_alloc(len);
+	if (!r->mb || mbuf_write_mem(r->mb, buf, len)) {
+		mem_deref(r);
+		return;
+	}
+
+	r->lcand = lcand;
+	r->src   = *src;
+	r->ts    = now;
+	memcpy(r->tid, tid, STUN_TID_SIZE);
+
+	hash_append(rc->ht, tid_hash(tid), &r->he, r);
+	list_prepend(&rc->lru, &r->le, r);
+	++rc->n;
+}
+
+
+/**
+ * Send the cached response again, if the request is a retransmission
+ *
+ * @param rc    Response cache
+ * @param lcand Local candidate that received the request
+ * @param sock  Socket the request was received on
+ * @param src   Source address of the request
+ * @param req   STUN request
+ * @param presz Number of bytes in preamble
+ *
+ * @return True if a cached response was sent, otherwise false
+ */
+bool trice_respcache_replay(struct trice_respcache *rc,
+			    struct ice_lcand *lcand, void *sock,
+			    const struct sa *src, const struct stun_msg *req,
+			    size_t presz)
+{
+	struct mbuf *mb;
+	struct resp *r;
+	int err;
+
+	if (!rc || !rc->ht || !rc->n || !lcand || !src || !req)
+		return false;
+
+	expire(rc, tmr_jiffies());
+
+	r = resp_find(rc, lcand, src, stun_msg_tid(req));
+	if (!r)
+		return false;
+
+	/* most recently used first */
+	list_unlink(&r->le);
+	list_prepend(&rc->lru, &r->le, r);
+
+	/* the send path may write to the preamble, send a copy */
+	mb = mbuf_alloc(presz + r->mb->end);
+	if (!mb)
+		return false;
+
+	mb->pos = presz;
+	err = mbuf_write_mem(mb, r->mb->buf, r->mb->end);
+	if (err)
+		goto out;
+
+	mb->pos = presz;
+
+	err = stun_send(lcand->attr.proto, sock, src, mb);
+	if (err)
+		goto out;
+
+	++rc->n_replay;
+
+ out:
+	mem_deref(mb);
+
+	return err == 0;
+}
+
+
+int trice_respcache_debug(struct re_printf *pf,
+			  const struct trice_respcache *rc)
+{
+	if (!rc)
+		return 0;
+
+	return re_hprintf(pf, " Cached STUN Responses: (%u) replayed=%llu\n",
+			  rc->n, rc->n_replay);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file rtt.c  Round-trip time estimation
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+enum {
+	RTO_MIN = 50,           /* Lower bound of the timeout in [ms] */
+	RTO_MAX = 3000,         /* Upper bound of the timeout in [ms] */
+	RTO_G   = 1000,         /* Clock granularity in [us]          */
+};
+
+
+/**
+ * Add a round-trip time sample to an estimate, as in RFC 6298
+ * section 2, with alpha=1/8 and beta=1/4
+ *
+ * @param rtt    Round-trip time estimate
+ * @param sample Round-trip time sample in [us]
+ */
+void trice_rtt_update(struct trice_rtt *rtt, uint32_t sample)
+{
+	uint32_t delta;
+
+	if (!rtt)
+		return;
+
+	rtt->last = sample;
+
+	if (!rtt->n++) {
+		rtt->srtt   = sample;
+		rtt->rttvar = sample / 2;
+		return;
+	}
+
+	delta = rtt->srtt > sample ? rtt->srtt - sample : sample - rtt->srtt;
+
+	rtt->rttvar = rtt->rttvar - rtt->rttvar / 4 + delta / 4;
+	rtt->srtt   = rtt->srtt - rtt->srtt / 8 + sample / 8;
+}
+
+
+/**
+ * Get the retransmission timeout of an estimate, as in RFC 6298
+ * section 2, bounded for connectivity checks
+ *
+ * @param rtt         Round-trip time estimate
+ * @param rto_default Timeout to use without samples, in [ms]
+ *
+ * @return Retransmission timeout in [ms]
+ */
+uint32_t trice_rtt_rto(const struct trice_rtt *rtt, uint32_t rto_default)
+{
+	uint64_t rto;
+
+	if (!rtt || !rtt->n)
+		return rto_default;
+
+	rto = (uint64_t)rtt->srtt + max(RTO_G, 4 * (uint64_t)rtt->rttvar);
+	rto = (rto + 999) / 1000;
+
+	return (uint32_t)min(max(rto, RTO_MIN), RTO_MAX);
+}
+
+
+/**
+ * Back off a retransmission timeout, after a check that was answered
+ * only after a retransmission, or not at all (Karn's algorithm)
+ *
+ * @param rto     Timeout of the check in [ms]
+ * @param elapsed Time until the response in [ms], 0 if none
+ *
+ * @return Backed-off timeout in [ms], longer than the elapsed time
+ */
+uint32_t trice_rtt_backoff(uint32_t rto, uint64_t elapsed)
+{
+	uint64_t b = (uint64_t)max(rto, RTO_MIN) * 2;
+
+	while (b <= elapsed && b < RTO_MAX)
+		b *= 2;
+
+	return (uint32_t)min(b, RTO_MAX);
+}
@@ -0,0 +1,325 @@
+/**
+ * @file rxbatch.c  Batched UDP receive for Local ICE Candidates
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_main.h>
+#include <re_stun.h>
+#include <re_udp.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+#define DEBUG_MODULE "rxbatch"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * Batched receive takes over the read handler of a UDP socket created
+ * by trice, and drains up to N datagrams per wakeup with recvmmsg().
+ *
+ * Each datagram goes to lcand->recvh first. If it is not handled, it
+ * continues through the UDP helpers above the ICE helper and ends up
+ * in the receive handler of the socket, just like a normal receive.
+ * UDP helpers registered below the ICE layer are not called.
+ */
+
+
+enum {
+	RXBATCH_BUFSZ = 8192,   /* same as the libre UDP default */
+	RXBATCH_MAX   = 256
+};
+
+
+#ifdef __linux__
+
+
+struct trice_rxbatch {
+	struct ice_lcand *lcand;     /* parent, not referenced */
+	int fd;
+	uint32_t n;
+	struct mbuf **mbv;
+	struct mmsghdr *msgv;
+	struct iovec *iov;
+	struct sockaddr_storage *addrv;
+};
+
+
+/* the socket may outlive us, it is then read by the UDP stack again */
+static void batch_stop(struct trice_rxbatch *rb)
+{
+	if (rb->fd < 0)
+		return;
+
+	fd_close(rb->fd);
+	rb->fd = -1;
+
+	(void)udp_thread_attach(rb->lcand->us);
+}
+
+
+static void destructor(void *arg)
+{
+	struct trice_rxbatch *rb = arg;
+	uint32_t i;
+
+	batch_stop(rb);
+
+	for (i=0; rb->mbv && i<rb->n; i++)
+		mem_deref(rb->mbv[i]);
+
+	mem_deref(rb->mbv);
+	mem_deref(rb->msgv);
+	mem_deref(rb->iov);
+	mem_deref(rb->addrv);
+}
+
+
+static void hist_add(struct ice_lcand *lcand, int n)
+{
+	unsigned bin = 0;
+
+	while (n > 1 && bin < ICE_LCAND_BATCH_BINS - 1) {
+		n >>= 1;
+		++bin;
+	}
+
+	++lcand->stats.batchv[bin];
+}
+
+
+/* prepare slot i for the next receive, replacing a buffer still in use */
+static int slot_reset(struct trice_rxbatch *rb, uint32_t i)
+{
+	struct mbuf *mb = rb->mbv[i];
+
+	if (mb && mem_nrefs(mb) > 1) {
+		rb->mbv[i] = mem_deref(mb);
+		mb = NULL;
+	}
+
+	if (!mb) {
+		mb = mbuf_alloc(RXBATCH_BUFSZ);
+		if (!mb)
+			return ENOMEM;
+
+		rb->mbv[i] = mb;
+	}
+
+	mb->pos = 0;
+	mb->end = 0;
+
+	rb->iov[i].iov_base = mb->buf;
+	rb->iov[i].iov_len  = mb->size;
+
+	memset(&rb->msgv[i], 0, sizeof(rb->msgv[i]));
+	rb->msgv[i].msg_hdr.msg_name    = &rb->addrv[i];
+	rb->msgv[i].msg_hdr.msg_namelen = sizeof(rb->addrv[i]);
+	rb->msgv[i].msg_hdr.msg_iov     = &rb->iov[i];
+	rb->msgv[i].msg_hdr.msg_iovlen  = 1;
+
+	return 0;
+}
+
+
+static void dispatch(struct ice_lcand *lcand, struct sa *src,
+		     struct mbuf *mb)
+{
+	lcand->stats.n_rx += 1;
+
+	if (lcand->recvh(lcand, IPPROTO_UDP, lcand->us, src, mb, lcand->arg))
+		return;
+
+	udp_recv_helper(lcand->us, src, mb, lcand->uh);
+}
+
+
+static void fd_handler(int flags, void *arg)
+{
+	struct trice_rxbatch *rb = arg;
+	struct ice_lcand *lcand;
+	uint32_t j;
+	int i, n;
+
+	if (!(flags & FD_READ))
+		return;
+
+	n = recvmmsg(rb->fd, rb->msgv, rb->n, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			DEBUG_WARNING("recvmmsg: %m\n", errno);
+		}
+		return;
+	}
+	if (n == 0)
+		return;
+
+	/* a receive handler may remove the candidate */
+	lcand = mem_ref(rb->lcand);
+	mem_ref(rb);
+
+	hist_add(lcand, n);
+
+	for (i=0; i<n; i++) {
+
+		struct mmsghdr *msg = &rb->msgv[i];
+		struct mbuf *mb = rb->mbv[i];
+		struct sa src;
+
+		if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+			DEBUG_NOTICE("truncated datagram dropped\n");
+			continue;
+		}
+
+		if (sa_set_sa(&src, msg->msg_hdr.msg_name))
+			continue;
+
+		mb->pos = 0;
+		mb->end = msg->msg_len;
+
+		dispatch(lcand, &src, mb);
+	}
+
+	for (i=0; i<n; i++) {
+
+		if (!slot_reset(rb, i))
+			continue;
+
+		/* the batch shrinks to the slots that are ready */
+		for (j=i; j<rb->n; j++)
+			rb->mbv[j] = mem_deref(rb->mbv[j]);
+
+		rb->n = i;
+		break;
+	}
+
+	if (!rb->n && rb->fd >= 0) {
+		DEBUG_WARNING("out of memory, batch disabled\n");
+		batch_stop(rb);
+	}
+
+	mem_deref(rb);
+	mem_deref(lcand);
+}
+
+
+/**
+ * Enable batched receive on the UDP socket of a local candidate
+ *
+ * @param rbp   Pointer to allocated batch receiver
+ * @param lcand Local candidate, owning its UDP socket
+ * @param n     Maximum number of datagrams per wakeup
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_rxbatch_alloc(struct trice_rxbatch **rbp, struct ice_lcand *lcand,
+			uint32_t n)
+{
+	struct trice_rxbatch *rb;
+	uint32_t i;
+	int fd, err = 0;
+
+	if (!rbp || !lcand || !lcand->us || !lcand->uh || !n)
+		return EINVAL;
+
+	rb = mem_zalloc(sizeof(*rb), destructor);
+	if (!rb)
+		return ENOMEM;
+
+	rb->lcand = lcand;
+	rb->fd = -1;
+	rb->n = min(n, RXBATCH_MAX);
+
+	rb->mbv   = mem_zalloc(rb->n * sizeof(*rb->mbv), NULL);
+	rb->msgv  = mem_zalloc(rb->n * sizeof(*rb->msgv), NULL);
+	rb->iov   = mem_zalloc(rb->n * sizeof(*rb->iov), NULL);
+	rb->addrv = mem_zalloc(rb->n * sizeof(*rb->addrv), NULL);
+	if (!rb->mbv || !rb->msgv || !rb->iov || !rb->addrv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<rb->n; i++) {
+		err = slot_reset(rb, i);
+		if (err)
+			goto out;
+	}
+
+	fd = udp_sock_fd(lcand->us, sa_af(&lcand->attr.addr));
+	if (fd < 0) {
+		err = EBADF;
+		goto out;
+	}
+
+	/* take over the read handler of the socket */
+	err = fd_listen(fd, FD_READ, fd_handler, rb);
+	if (err)
+		goto out;
+
+	rb->fd = fd;
+
+ out:
+	if (err)
+		mem_deref(rb);
+	else
+		*rbp = rb;
+
+	return err;
+}
+
+
+#else
+
+
+/* batched receive needs recvmmsg(), use the normal receive path */
+int trice_rxbatch_alloc(struct trice_rxbatch **rbp, struct ice_lcand *lcand,
+			uint32_t n)
+{
+	(void)rbp;
+	(void)lcand;
+	(void)n;
+
+	return 0;
+}
+
+
+#endif
+
+
+int trice_rxbatch_debug(struct re_printf *pf, const struct ice_lcand *lcand)
+{
+	int i, err = 0;
+
+	if (!lcand || !lcand->rxb)
+		return 0;
+
+	err |= re_hprintf(pf, "rx-batch:");
+
+	for (i=0; i<ICE_LCAND_BATCH_BINS; i++) {
+		err |= re_hprintf(pf, " %u%s=%zu", 1u << i,
+				  i == ICE_LCAND_BATCH_BINS - 1 ? "+" : "",
+				  lcand->stats.batchv[i]);
+	}
+
+	return err;
+}
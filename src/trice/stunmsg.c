@@ -0,0 +1,165 @@
+/**
+ * @file stunmsg.c  MESSAGE-INTEGRITY and FINGERPRINT of encoded messages
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_ice.h>
+#include <re_hmac.h>
+#include <re_crc32.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+enum {
+	MI_SIZE = 20,
+	FP_SIZE = 4,
+	FP_XOR  = 0x5354554e,
+};
+
+
+/*
+ * MESSAGE-INTEGRITY is computed with the HMACs of the ICE Media object,
+ * keyed once with the local and the remote password, instead of keying
+ * a new HMAC for every message. The length in the STUN header is
+ * patched in place while hashing, as described in RFC 5389.
+ */
+
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return ntohs(v);
+}
+
+
+static void hdr_set_len(uint8_t *hdr, size_t len)
+{
+	uint16_t v = htons((uint16_t)(len - STUN_HEADER_SIZE));
+
+	memcpy(hdr + 2, &v, sizeof(v));
+}
+
+
+/**
+ * Check the MESSAGE-INTEGRITY of an encoded STUN message
+ *
+ * @param hmac  HMAC-SHA1 keyed with the password
+ * @param mb    Buffer with the message
+ * @param start Start of the message in the buffer
+ *
+ * @return 0 if valid, EBADMSG if wrong, EPROTO if missing
+ */
+int trice_stun_chk_mi(struct hmac *hmac, struct mbuf *mb, size_t start)
+{
+	uint8_t md[MI_SIZE];
+	size_t len, off = STUN_HEADER_SIZE;
+	uint8_t *p;
+
+	if (mb->end < start + STUN_HEADER_SIZE)
+		return EBADMSG;
+
+	p   = mb->buf + start;
+	len = STUN_HEADER_SIZE + get_u16(p + 2);
+
+	if (mb->end - start < len)
+		return EBADMSG;
+
+	while (off + STUN_ATTR_HEADER_SIZE <= len) {
+
+		uint16_t type = get_u16(p + off);
+		uint16_t alen = get_u16(p + off + 2);
+		int err;
+
+		if (type != STUN_ATTR_MSG_INTEGRITY) {
+			off += STUN_ATTR_HEADER_SIZE + ((alen + 3) & ~3);
+			continue;
+		}
+
+		if (alen != MI_SIZE ||
+		    off + STUN_ATTR_HEADER_SIZE + MI_SIZE > len)
+			return EBADMSG;
+
+		hdr_set_len(p, off + STUN_ATTR_HEADER_SIZE + MI_SIZE);
+		err = hmac_digest(hmac, md, sizeof(md), p, off);
+		hdr_set_len(p, len);
+		if (err)
+			return err;
+
+		if (memcmp(md, p + off + STUN_ATTR_HEADER_SIZE, MI_SIZE))
+			return EBADMSG;
+
+		return 0;
+	}
+
+	return EPROTO;
+}
+
+
+/**
+ * Append MESSAGE-INTEGRITY to an encoded STUN message
+ *
+ * @param hmac  HMAC-SHA1 keyed with the password
+ * @param mb    Buffer with the message, which ends at mb->end
+ * @param start Start of the message in the buffer
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_stun_append_mi(struct hmac *hmac, struct mbuf *mb, size_t start)
+{
+	uint8_t md[MI_SIZE];
+	size_t len = mb->end - start;
+	int err = 0;
+
+	hdr_set_len(mb->buf + start, len + STUN_ATTR_HEADER_SIZE + MI_SIZE);
+
+	err = hmac_digest(hmac, md, sizeof(md), mb->buf + start, len);
+	if (err)
+		return err;
+
+	mb->pos = mb->end;
+	err |= mbuf_write_u16(mb, htons(STUN_ATTR_MSG_INTEGRITY));
+	err |= mbuf_write_u16(mb, htons(MI_SIZE));
+	err |= mbuf_write_mem(mb, md, sizeof(md));
+
+	return err;
+}
+
+
+/**
+ * Append FINGERPRINT to an encoded STUN message
+ *
+ * @param mb    Buffer with the message, which ends at mb->end
+ * @param start Start of the message in the buffer
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_stun_append_fp(struct mbuf *mb, size_t start)
+{
+	size_t len = mb->end - start;
+	uint32_t fp;
+	int err = 0;
+
+	hdr_set_len(mb->buf + start, len + STUN_ATTR_HEADER_SIZE + FP_SIZE);
+
+	fp = crc32(0, mb->buf + start, (uint32_t)len) ^ FP_XOR;
+
+	mb->pos = mb->end;
+	err |= mbuf_write_u16(mb, htons(STUN_ATTR_FINGERPRINT));
+	err |= mbuf_write_u16(mb, htons(FP_SIZE));
+	err |= mbuf_write_u32(mb, htonl(fp));
+
+	return err;
+}
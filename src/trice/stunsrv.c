@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <stdarg.h>
 #include <string.h>
 #include <re_types.h>
 #include <re_fmt.h>
@@ -10,6 +11,7 @@
 #include <re_mbuf.h>
 #include <re_list.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_stun.h>
 #include <re_ice.h>
@@ -28,6 +30,60 @@
 static const char *sw = "ice stunsrv v" VERSION " (" ARCH "/" OS ")";
 
 
+static inline bool frag_eq(const struct pl *pl, const char *frag, size_t len)
+{
+	return pl->l == len && 0 == memcmp(pl->p, frag, len);
+}
+
+
+/* send a response with MESSAGE-INTEGRITY and FINGERPRINT */
+static int stunsrv_send(struct trice *icem, struct ice_lcand *lcand,
+			void *sock, const struct sa *dst, size_t presz,
+			const struct trice_stunreq *req, bool cache,
+			const struct stun_errcode *ec, uint32_t attrc, ...)
+{
+	struct mbuf *mb;
+	va_list ap;
+	int err;
+
+	mb = mbuf_alloc(256);
+	if (!mb)
+		return ENOMEM;
+
+	mb->pos = presz;
+	mb->end = presz;
+
+	va_start(ap, attrc);
+	err = stun_msg_vencode(mb, req->method,
+			       ec ? STUN_CLASS_ERROR_RESP
+			          : STUN_CLASS_SUCCESS_RESP,
+			       req->tid, ec, NULL, 0, false, 0x00,
+			       attrc, ap);
+	va_end(ap);
+	if (err)
+		goto out;
+
+	err  = trice_stun_append_mi(icem->lhmac, mb, presz);
+	err |= trice_stun_append_fp(mb, presz);
+	if (err)
+		goto out;
+
+	if (cache) {
+		trice_respcache_add(&icem->respc, lcand, dst, req->tid,
+				    mb->buf + presz, mb->end - presz);
+	}
+
+	mb->pos = presz;
+
+	err = stun_send(lcand->attr.proto, sock, dst, mb);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
 /*
  * NOTE about TCP-candidates:
  *
@@ -74,12 +130,12 @@ static int handle_stun_full(struct trice *icem, struct ice_lcand *lcand,
 	}
 
 	/* already valid, skip */
-	pair = trice_candpair_find(&icem->validl, lcand, rcand);
+	pair = trice_candpair_find(icem, &icem->validl.list, lcand, rcand);
 	if (pair)
 		goto out;
 
 	/* note: the candidate-pair can exist in either list */
-	pair = trice_candpair_find(&icem->checkl, lcand, rcand);
+	pair = trice_candpair_find(icem, &icem->checkl.list, lcand, rcand);
 	if (!pair) {
 		if (icem->conf.enable_prflx) {
 			DEBUG_WARNING("{%u} candidate pair not found:"
@@ -94,6 +150,12 @@ static int handle_stun_full(struct trice *icem, struct ice_lcand *lcand,
 		if (icem->lrole == ICE_ROLE_CONTROLLED) {
 
 			pair->nominated = true;
+
+			/* ICE-lite sends no checks, the pair is valid now */
+			if (icem->muxa)
+				trice_candpair_make_valid(icem, pair);
+
+			trice_consent_auto(icem, pair);
 		}
 	}
 
@@ -120,11 +182,47 @@ static int handle_stun_full(struct trice *icem, struct ice_lcand *lcand,
 }
 
 
+/* keep only what is needed to respond, the request can be buffered */
+static void stunreq_decode(struct trice_stunreq *sreq,
+			   const struct stun_msg *req)
+{
+	struct stun_attr *attr;
+
+	memset(sreq, 0, sizeof(*sreq));
+
+	memcpy(sreq->tid, stun_msg_tid(req), STUN_TID_SIZE);
+	sreq->method = stun_msg_method(req);
+	sreq->remote_role = ICE_ROLE_UNKNOWN;
+
+	attr = stun_msg_attr(req, STUN_ATTR_CONTROLLED);
+	if (attr) {
+		sreq->remote_role = ICE_ROLE_CONTROLLED;
+		sreq->tiebrk = attr->v.uint64;
+	}
+
+	attr = stun_msg_attr(req, STUN_ATTR_CONTROLLING);
+	if (attr) {
+		sreq->remote_role = ICE_ROLE_CONTROLLING;
+		sreq->tiebrk = attr->v.uint64;
+	}
+
+	attr = stun_msg_attr(req, STUN_ATTR_PRIORITY);
+	if (attr) {
+		sreq->prio = attr->v.uint32;
+		sreq->has_prio = true;
+	}
+
+	sreq->use_cand = stun_msg_attr(req, STUN_ATTR_USE_CAND) != NULL;
+}
+
+
 static int stunsrv_ereply(struct trice *icem, struct ice_lcand *lcand,
 			  void *sock, const struct sa *src,
-			  size_t presz, const struct stun_msg *req,
-			  uint16_t scode, const char *reason)
+			  size_t presz, const struct trice_stunreq *req,
+			  bool cache, uint16_t scode, const char *reason)
 {
+	struct stun_errcode ec;
+
 	DEBUG_WARNING("[%H] replying error to %J (%u %s)\n",
 		      trice_cand_print, lcand,
 		      src,
@@ -137,27 +235,37 @@ static int stunsrv_ereply(struct trice *icem, struct ice_lcand *lcand,
 		     trice_cand_print, lcand,
 		     scode, reason);
 
-	return stun_ereply(lcand->attr.proto, sock, src, presz, req,
-			   scode, reason,
-			   (uint8_t *)icem->lpwd, strlen(icem->lpwd), true, 1,
-			   STUN_ATTR_SOFTWARE, icem->sw ? icem->sw : sw);
+	ec.code   = scode;
+	ec.reason = (char *)reason;
+
+	return stunsrv_send(icem, lcand, sock, src, presz, req, cache, &ec, 1,
+			    STUN_ATTR_SOFTWARE, icem->sw ? icem->sw : sw);
 }
 
 
 int trice_stund_recv(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz)
+		    struct stun_msg *req, struct mbuf *mb, size_t presz)
 {
+	struct trice_stunreq sreq;
 	struct stun_attr *attr;
 	struct pl lu, ru;
+	const char *colon;
+	size_t len;
 	int err;
 
+	/* over the budget of its source, dropped before any checking */
+	if (!trice_ratelim_admit(&icem->reqlim, &icem->conf, src))
+		return EAGAIN;
+
+	stunreq_decode(&sreq, req);
+
 	/* RFC 5389: Fingerprint errors are silently discarded */
 	err = stun_msg_chk_fingerprint(req);
 	if (err)
 		return err;
 
-	err = stun_msg_chk_mi(req, (uint8_t *)icem->lpwd, strlen(icem->lpwd));
+	err = trice_stun_chk_mi(icem->lhmac, mb, presz);
 	if (err) {
 		DEBUG_WARNING("message-integrity failed (src=%J)\n", src);
 		if (err == EBADMSG)
@@ -170,111 +278,108 @@ int trice_stund_recv(struct trice *icem, struct ice_lcand *lcand,
 	if (!attr)
 		goto badmsg;
 
-	err = re_regex(attr->v.username, strlen(attr->v.username),
-		       "[^:]+:[^]+", &lu, &ru);
-	if (err) {
+	/* "LFRAG:RFRAG", split on the first colon */
+	len   = str_len(attr->v.username);
+	colon = memchr(attr->v.username, ':', len);
+	if (colon) {
+		lu.p = attr->v.username;
+		lu.l = colon - attr->v.username;
+		ru.p = colon + 1;
+		ru.l = len - lu.l - 1;
+	}
+
+	if (!colon || !lu.l || !ru.l) {
 		DEBUG_WARNING("could not parse USERNAME attribute (%s)\n",
 			      attr->v.username);
 		goto unauth;
 	}
-	if (pl_strcmp(&lu, icem->lufrag)) {
+
+	/* the length is compared first, a mismatch is rejected cheaply */
+	if (!frag_eq(&lu, icem->lufrag, icem->lufrag_len)) {
 		DEBUG_WARNING("local ufrag err (expected %s, actual %r)\n",
 			      icem->lufrag, &lu);
 		goto unauth;
 	}
-	if (str_isset(icem->rufrag) && pl_strcmp(&ru, icem->rufrag)) {
+	if (icem->rufrag_len &&
+	    !frag_eq(&ru, icem->rufrag, icem->rufrag_len)) {
 		DEBUG_WARNING("remote ufrag err (expected %s, actual %r)\n",
 			      icem->rufrag, &ru);
 		goto unauth;
 	}
 
+	/* a retransmission gets the same response, without side effects */
+	if (trice_respcache_replay(&icem->respc, lcand, sock, src, req, presz))
+		return 0;
+
 	if (icem->lrole == ICE_ROLE_UNKNOWN) {
-		err = trice_reqbuf_append(icem, lcand, sock, src, req, presz);
+		err = trice_reqbuf_append(icem, lcand, sock, src, &sreq,
+					  presz);
 		if (err) {
 			DEBUG_WARNING("unable to buffer STUN request: %m\n",
 				      err);
 		}
 	}
 
-	return trice_stund_recv_role_set(icem, lcand, sock, src, req, presz);
+	return trice_stund_recv_role_set(icem, lcand, sock, src, &sreq,
+					 presz);
 
  badmsg:
-	return stunsrv_ereply(icem, lcand, sock, src, presz, req,
+	return stunsrv_ereply(icem, lcand, sock, src, presz, &sreq, false,
 			      400, "Bad Request");
 
  unauth:
-	return stunsrv_ereply(icem, lcand, sock, src, presz, req,
+	return stunsrv_ereply(icem, lcand, sock, src, presz, &sreq, false,
 			      401, "Unauthorized");
 }
 
 
 int trice_stund_recv_role_set(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz)
+		    const struct trice_stunreq *req, size_t presz)
 {
-	struct stun_attr *attr;
-	enum ice_role remote_role = ICE_ROLE_UNKNOWN;
-	uint64_t tiebrk = 0;
-	uint32_t prio_prflx;
 	int err;
-	bool use_cand = false;
-
-	attr = stun_msg_attr(req, STUN_ATTR_CONTROLLED);
-	if (attr) {
-		remote_role = ICE_ROLE_CONTROLLED;
-		tiebrk = attr->v.uint64;
-	}
-
-	attr = stun_msg_attr(req, STUN_ATTR_CONTROLLING);
-	if (attr) {
-		remote_role = ICE_ROLE_CONTROLLING;
-		tiebrk = attr->v.uint64;
-	}
 
-	if (remote_role == ICE_ROLE_UNKNOWN)
+	if (req->remote_role == ICE_ROLE_UNKNOWN)
 		goto badmsg;
 
-	if (remote_role == icem->lrole) {
+	if (req->remote_role == icem->lrole) {
 		DEBUG_NOTICE("role conflict detected (both %s)\n",
-			     ice_role2name(remote_role));
+			     ice_role2name(req->remote_role));
 
-		if (icem->tiebrk >= tiebrk)
+		if (icem->tiebrk >= req->tiebrk)
 			trice_switch_local_role(icem);
 		else
 			goto conflict;
 	}
 
-	attr = stun_msg_attr(req, STUN_ATTR_PRIORITY);
-	if (attr)
-		prio_prflx = attr->v.uint32;
-	else
+	if (!req->has_prio)
 		goto badmsg;
 
-	attr = stun_msg_attr(req, STUN_ATTR_USE_CAND);
-	if (attr)
-		use_cand = true;
-
-	err = handle_stun_full(icem, lcand, sock, src, prio_prflx, use_cand);
+	err = handle_stun_full(icem, lcand, sock, src, req->prio,
+			       req->use_cand);
 
 	if (err)
 		goto badmsg;
 
+	/* the shared socket routes this peer to us from now on */
+	if (icem->muxa)
+		trice_mux_learn(icem->muxa, sock, src);
+
 	trice_tracef(icem, 32,
 		     "[%u] STUNSRV: Tx success respons [%H ---> %J]\n",
 		     lcand->attr.compid,
 		     trice_cand_print, lcand, src);
 
-	return stun_reply(lcand->attr.proto, sock, src, presz, req,
-			  (uint8_t *)icem->lpwd, strlen(icem->lpwd), true, 2,
-			  STUN_ATTR_XOR_MAPPED_ADDR, src,
-			  STUN_ATTR_SOFTWARE, icem->sw ? icem->sw : sw);
+	return stunsrv_send(icem, lcand, sock, src, presz, req, true, NULL, 2,
+			    STUN_ATTR_XOR_MAPPED_ADDR, src,
+			    STUN_ATTR_SOFTWARE, icem->sw ? icem->sw : sw);
 
 
  badmsg:
-	return stunsrv_ereply(icem, lcand, sock, src, presz, req,
+	return stunsrv_ereply(icem, lcand, sock, src, presz, req, true,
 			      400, "Bad Request");
 
  conflict:
-	return stunsrv_ereply(icem, lcand, sock, src, presz, req,
+	return stunsrv_ereply(icem, lcand, sock, src, presz, req, true,
 			      487, "Role Conflict");
 }
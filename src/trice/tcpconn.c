@@ -10,6 +10,7 @@
 #include <re_mbuf.h>
 #include <re_list.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_tcp.h>
 #include <re_udp.h>
@@ -25,6 +26,11 @@
 #include <re_dbg.h>
 
 
+enum {
+	TCPCONN_BUF = 131072,  /* Buffered bytes per TCP connection */
+};
+
+
 /* `mb' contains a complete frame */
 static bool shim_frame_handler(struct mbuf *mb, void *arg)
 {
@@ -34,10 +40,31 @@ static bool shim_frame_handler(struct mbuf *mb, void *arg)
 }
 
 
+/* all frames of a segment that are not STUN, in one call */
+static void shim_framev_handler(struct mbuf **mbv, size_t n, void *arg)
+{
+	struct ice_tcpconn *conn = arg;
+	struct trice *icem = conn->icem;
+
+	if (icem->tcp_framevh) {
+		icem->tcp_framevh(conn->tc, &conn->paddr, mbv, n,
+				  icem->tcp_framev_arg);
+	}
+}
+
+
+static void framev_handler_update(struct ice_tcpconn *conn)
+{
+	shim_set_framev_handler(conn->shim, conn->icem->tcp_framevh ?
+				shim_framev_handler : NULL);
+}
+
+
 static void tcp_estab_handler(void *arg)
 {
 	struct ice_tcpconn *conn = arg;
 	struct trice *icem = conn->icem;
+	struct shim_conf conf = {0, TCPCONN_BUF};
 	struct le *le;
 	int err;
 
@@ -46,11 +73,13 @@ static void tcp_estab_handler(void *arg)
 	trice_printf(icem, "TCP established (local=%J <---> peer=%J)\n",
 		    &conn->laddr, &conn->paddr);
 
-	err = shim_insert(&conn->shim, conn->tc, conn->layer,
+	err = shim_insert(&conn->shim, conn->tc, conn->layer, &conf,
 			  shim_frame_handler, conn);
 	if (err)
 		goto out;
 
+	framev_handler_update(conn);
+
 	if (!icem->checklist)
 		goto out;
 
@@ -113,7 +142,7 @@ static void tcp_close_handler(int err, void *arg)
 	 * that are using this conn
 	 */
 
-	le = conn->icem->checkl.head;
+	le = conn->icem->checkl.list.head;
 	while (le) {
 		struct ice_candpair *pair = le->data;
 
@@ -123,7 +152,7 @@ static void tcp_close_handler(int err, void *arg)
 		    pair->lcand->attr.proto == IPPROTO_TCP &&
 		    sa_cmp(&pair->rcand->attr.addr, &conn->paddr, SA_ALL)) {
 
-			trice_candpair_failed(pair, err, 0);
+			trice_candpair_failed(icem, pair, err, 0);
 
 			if (icem->checklist) {
 				icem->checklist->failh(err, 0,
@@ -237,6 +266,36 @@ int trice_conn_alloc(struct list *connl, struct trice *icem, unsigned compid,
 }
 
 
+/**
+ * Set the handler of frames on the TCP-connections that are not STUN.
+ * All such frames of a TCP segment are passed in one call. Without a
+ * handler, each frame is passed to the TCP helpers above the ICE layer,
+ * one per segment, and the next frames wait for the next segment.
+ *
+ * A TCP-connection buffers at most 128 KiB of frames not delivered yet,
+ * and is closed beyond that. There is no backpressure on the peer,
+ * libre cannot stop reading a TCP-connection.
+ *
+ * @param icem    ICE Media object
+ * @param framevh Frame vector handler, or NULL
+ * @param arg     Handler argument
+ */
+void trice_set_tcp_framev_handler(struct trice *icem,
+				  trice_tcp_framev_h *framevh, void *arg)
+{
+	struct le *le;
+
+	if (!icem)
+		return;
+
+	icem->tcp_framevh    = framevh;
+	icem->tcp_framev_arg = arg;
+
+	for (le = list_head(&icem->connl); le; le = le->next)
+		framev_handler_update(le->data);
+}
+
+
 /* NOTE: laddr matching is SA_ADDR only */
 struct ice_tcpconn *trice_conn_find(struct list *connl, unsigned compid,
 				  const struct sa *laddr,
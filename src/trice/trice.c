@@ -8,7 +8,10 @@
 #include <re_mem.h>
 #include <re_mbuf.h>
 #include <re_list.h>
+#include <re_hash.h>
+#include <re_hmac.h>
 #include <re_tmr.h>
+#include <re_tmrw.h>
 #include <re_sa.h>
 #include <re_stun.h>
 #include <re_ice.h>
@@ -27,28 +30,59 @@ static const struct trice_conf conf_default = {
 	false,
 	false,
 	false,
-	true
+	true,
+	0,
+	0,
+	0,
+	0
 };
 
 
 static void trice_destructor(void *data)
 {
 	struct trice *icem = data;
+	int i;
 
+	mem_deref(icem->muxa);
 	mem_deref(icem->checklist);
+	mem_deref(icem->pacer);
+	trice_consent_flush(icem);
+	mem_deref(icem->tmrw);
 
-	list_flush(&icem->validl);
-	list_flush(&icem->checkl);
+	trice_pairl_flush(&icem->validl);
+	trice_pairl_flush(&icem->checkl);
 	list_flush(&icem->lcandl);
 	list_flush(&icem->rcandl);
 	list_flush(&icem->reqbufl);
+	trice_respcache_flush(&icem->respc);
+	trice_ratelim_flush(&icem->reqlim);
 
 	list_flush(&icem->connl);
+	list_flush(&icem->txq);
+
+	for (i=0; i<TRICE_PAIR_STATES; i++)
+		trice_pairl_clear(&icem->statev[i].pairl);
+
+	/* candidates may outlive us, if referenced by the application */
+	hash_clear(icem->lcandh);
+	hash_clear(icem->rcandh);
+	hash_clear(icem->pairh);
+	hash_clear(icem->fndgrph);
+	mem_deref(icem->lcandh);
+	mem_deref(icem->rcandh);
+	mem_deref(icem->pairh);
+	mem_deref(icem->fndgrph);
+
+	hash_flush(icem->fndh);
+	mem_deref(icem->fndh);
 
 	mem_deref(icem->rufrag);
+	mem_deref(icem->username);
 	mem_deref(icem->rpwd);
+	mem_deref(icem->rhmac);
 	mem_deref(icem->lufrag);
 	mem_deref(icem->lpwd);
+	mem_deref(icem->lhmac);
 	mem_deref(icem->sw);
 }
 
@@ -73,7 +107,7 @@ int trice_alloc(struct trice **icemp, const struct trice_conf *conf,
 	       const char *lufrag, const char *lpwd)
 {
 	struct trice *icem;
-	int err = 0;
+	int i, err = 0;
 
 	if (!icemp || !lufrag || !lpwd)
 		return EINVAL;
@@ -89,19 +123,42 @@ int trice_alloc(struct trice **icemp, const struct trice_conf *conf,
 
 	icem->conf = conf ? *conf : conf_default;
 	list_init(&icem->reqbufl);
+	list_init(&icem->consentl);
+	tmrw_init(&icem->tmr_consent);
 	list_init(&icem->lcandl);
 	list_init(&icem->rcandl);
-	list_init(&icem->checkl);
-	list_init(&icem->validl);
+	trice_pairl_init(&icem->checkl);
+	trice_pairl_init(&icem->validl);
+
+	for (i=0; i<TRICE_PAIR_STATES; i++)
+		trice_pairl_init(&icem->statev[i].pairl);
 
 	icem->lrole = role;
 	icem->tiebrk = rand_u64();
 
+	err  = hash_alloc(&icem->lcandh, TRICE_CAND_HASH_SIZE);
+	err |= hash_alloc(&icem->rcandh, TRICE_CAND_HASH_SIZE);
+	err |= hash_alloc(&icem->pairh, TRICE_PAIR_HASH_SIZE);
+	err |= hash_alloc(&icem->fndh, TRICE_FND_HASH_SIZE);
+	err |= hash_alloc(&icem->fndgrph, TRICE_FND_HASH_SIZE);
+	err |= trice_respcache_init(&icem->respc);
+	err |= trice_ratelim_init(&icem->reqlim);
+	if (err)
+		goto out;
+
 	err |= str_dup(&icem->lufrag, lufrag);
 	err |= str_dup(&icem->lpwd, lpwd);
 	if (err)
 		goto out;
 
+	icem->lufrag_len = str_len(lufrag);
+
+	/* keyed once, used for all incoming requests and our responses */
+	err = hmac_create(&icem->lhmac, HMAC_HASH_SHA1,
+			  (uint8_t *)icem->lpwd, str_len(icem->lpwd));
+	if (err)
+		goto out;
+
  out:
 	if (err)
 		mem_deref(icem);
@@ -114,22 +171,52 @@ int trice_alloc(struct trice **icemp, const struct trice_conf *conf,
 
 int trice_set_remote_ufrag(struct trice *icem, const char *rufrag)
 {
+	int err;
+
 	if (!icem || !rufrag)
 		return EINVAL;
 
 	icem->rufrag = mem_deref(icem->rufrag);
-	return str_dup(&icem->rufrag, rufrag);
+	icem->rufrag_len = 0;
+	icem->username = mem_deref(icem->username);
+
+	/* USERNAME of outgoing checks, "RFRAG:LFRAG" */
+	err = re_sdprintf(&icem->username, "%s:%s", rufrag, icem->lufrag);
+	if (err)
+		return err;
+
+	err = str_dup(&icem->rufrag, rufrag);
+	if (err)
+		return err;
+
+	icem->rufrag_len = str_len(rufrag);
+	++icem->chk_gen;
+
+	return 0;
 }
 
 
 int trice_set_remote_pwd(struct trice *icem, const char *rpwd)
 {
+	int err;
+
 	if (!icem || !rpwd)
 		return EINVAL;
 
-	icem->rpwd = mem_deref(icem->rpwd);
+	icem->rpwd  = mem_deref(icem->rpwd);
+	icem->rhmac = mem_deref(icem->rhmac);
+
+	err = str_dup(&icem->rpwd, rpwd);
+	if (err)
+		return err;
+
+	/* keyed once, used for all our checks and their responses */
+	err = hmac_create(&icem->rhmac, HMAC_HASH_SHA1,
+			  (uint8_t *)icem->rpwd, str_len(icem->rpwd));
+	if (err)
+		icem->rpwd = mem_deref(icem->rpwd);
 
-	return str_dup(&icem->rpwd, rpwd);
+	return err;
 }
 
 
@@ -147,6 +234,56 @@ int trice_set_software(struct trice *icem, const char *sw)
 }
 
 
+/**
+ * Use a shared pacer for the connectivity checks of this ICE Media,
+ * instead of its own pacing timer. The pacer must be set before the
+ * checklist is started, and then the checklist interval is not used.
+ *
+ * @param icem  ICE Media object
+ * @param pacer Shared pacer, or NULL for none
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_set_pacer(struct trice *icem, struct trice_pacer *pacer)
+{
+	if (!icem)
+		return EINVAL;
+
+	if (icem->checklist)
+		return EALREADY;
+
+	mem_deref(icem->pacer);
+	icem->pacer = mem_ref(pacer);
+
+	return 0;
+}
+
+
+/**
+ * Use a timer wheel for the pacing and consent timers of this ICE
+ * Media, instead of the main timer list. The timer wheel must be set
+ * before the checklist is started.
+ *
+ * @param icem ICE Media object
+ * @param tmrw Timer wheel, or NULL for none
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int trice_set_tmrw(struct trice *icem, struct tmrw *tmrw)
+{
+	if (!icem)
+		return EINVAL;
+
+	if (icem->checklist || !list_isempty(&icem->consentl))
+		return EALREADY;
+
+	mem_deref(icem->tmrw);
+	icem->tmrw = mem_ref(tmrw);
+
+	return 0;
+}
+
+
 struct trice_conf *trice_conf(struct trice *icem)
 {
 	return icem ? &icem->conf : NULL;
@@ -212,11 +349,13 @@ static void trice_reqbuf_process(struct trice *icem)
 			     "request\n");
 
 		(void)trice_stund_recv_role_set(icem, reqbuf->lcand,
-				reqbuf->sock, &reqbuf->src, reqbuf->req,
+				reqbuf->sock, &reqbuf->src, &reqbuf->req,
 				reqbuf->presz);
 
 		mem_deref(reqbuf);
 	}
+
+	icem->reqbufc = 0;
 }
 
 
@@ -250,10 +389,11 @@ int trice_set_role(struct trice *trice, enum ice_role role)
 		refresh = true;
 
 	trice->lrole = role;
+	++trice->chk_gen;
 
 	/* Create candidate pairs and process pending requests */
 	if (refresh) {
-		trice_candpair_prio_order(&trice->checkl,
+		trice_candpair_prio_order(trice,
 					  role == ICE_ROLE_CONTROLLING);
 	}
 	else {
@@ -293,7 +433,7 @@ enum ice_role trice_local_role(const struct trice *icem)
 int trice_debug(struct re_printf *pf, const struct trice *icem)
 {
 	struct le *le;
-	int err = 0;
+	int i, err = 0;
 
 	if (!icem)
 		return 0;
@@ -310,17 +450,37 @@ int trice_debug(struct re_printf *pf, const struct trice *icem)
 	err |= re_hprintf(pf, " Remote Candidates: %H",
 			  trice_rcands_debug, &icem->rcandl);
 	err |= re_hprintf(pf, " Check list: ");
-	err |= trice_candpairs_debug(pf, icem->conf.ansi, &icem->checkl);
+	err |= trice_candpairs_debug(pf, icem->conf.ansi,
+				     &icem->checkl.list);
 
 	err |= re_hprintf(pf, " Valid list: ");
-	err |= trice_candpairs_debug(pf, icem->conf.ansi, &icem->validl);
+	err |= trice_candpairs_debug(pf, icem->conf.ansi,
+				     &icem->validl.list);
+
+	err |= re_hprintf(pf, " Pair states:");
+	for (i=0; i<TRICE_PAIR_STATES; i++) {
+		err |= re_hprintf(pf, " %s=%u",
+				  trice_candpair_state2name(i),
+				  icem->statev[i].n);
+	}
+	err |= re_hprintf(pf, "\n");
 
-	err |= re_hprintf(pf, " Buffered STUN Requests: (%u)\n",
-			  list_count(&icem->reqbufl));
+	err |= re_hprintf(pf, " Buffered STUN Requests: (%u)"
+			  " replaced=%llu dropped=%llu\n",
+			  icem->reqbufc,
+			  icem->reqbuf_ndup, icem->reqbuf_ndrop);
+	err |= trice_respcache_debug(pf, &icem->respc);
+	err |= trice_ratelim_debug(pf, &icem->reqlim, &icem->conf);
 
 	if (icem->checklist)
 		err |= trice_checklist_debug(pf, icem->checklist);
 
+	err |= re_hprintf(pf, " Consent Freshness: (%u)\n",
+			  list_count(&icem->consentl));
+
+	if (icem->muxa)
+		err |= trice_muxa_debug(pf, icem->muxa);
+
 	err |= re_hprintf(pf, " TCP Connections: (%u)\n",
 			  list_count(&icem->connl));
 
@@ -370,7 +530,7 @@ struct list *trice_rcandl(const struct trice *icem)
  */
 struct list *trice_checkl(const struct trice *icem)
 {
-	return icem ? (struct list *)&icem->checkl : NULL;
+	return icem ? (struct list *)&icem->checkl.list : NULL;
 }
 
 
@@ -383,7 +543,7 @@ struct list *trice_checkl(const struct trice *icem)
  */
 struct list *trice_validl(const struct trice *icem)
 {
-	return icem ? (struct list *)&icem->validl : NULL;
+	return icem ? (struct list *)&icem->validl.list : NULL;
 }
 
 
@@ -447,10 +607,62 @@ void trice_switch_local_role(struct trice *ice)
 		     ice_role2name(ice->lrole), ice_role2name(new_role));
 
 	ice->lrole = new_role;
+	++ice->chk_gen;
 
 	/* recompute pair priorities for all media streams */
-	trice_candpair_prio_order(&ice->checkl,
-				  ice->lrole == ICE_ROLE_CONTROLLING);
+	trice_candpair_prio_order(ice, ice->lrole == ICE_ROLE_CONTROLLING);
+}
+
+
+enum pkt_class {
+	PKT_STUN,
+	PKT_DTLS,
+	PKT_RTP,
+	PKT_OTHER
+};
+
+
+/*
+ * RFC 7983 -- Multiplexing Scheme Updates for SRTP with DTLS
+ *
+ *               +----------------+
+ *               |        [0..3] -+--> forward to STUN
+ *               |      [16..19] -+--> forward to ZRTP
+ *   packet -->  |      [20..63] -+--> forward to DTLS
+ *               |      [64..79] -+--> forward to TURN Channel
+ *               |    [128..191] -+--> forward to RTP/RTCP
+ *               +----------------+
+ *
+ * A STUN packet must also be long enough for the header and
+ * carry the magic cookie, before it is worth decoding.
+ */
+static enum pkt_class pkt_classify(const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	size_t n = mbuf_get_left(mb);
+	uint32_t cookie;
+
+	if (n < 1)
+		return PKT_OTHER;
+
+	if (p[0] <= 3) {
+
+		if (n < STUN_HEADER_SIZE)
+			return PKT_OTHER;
+
+		cookie = (uint32_t)p[4]<<24 | (uint32_t)p[5]<<16 |
+			(uint32_t)p[6]<<8 | (uint32_t)p[7];
+
+		return cookie == STUN_MAGIC_COOKIE ? PKT_STUN : PKT_OTHER;
+	}
+
+	if (20 <= p[0] && p[0] <= 63)
+		return PKT_DTLS;
+
+	if (128 <= p[0] && p[0] <= 191)
+		return PKT_RTP;
+
+	return PKT_OTHER;
 }
 
 
@@ -462,8 +674,25 @@ bool trice_stun_process(struct trice *icem, struct ice_lcand *lcand,
 	struct stun_msg *msg = NULL;
 	struct stun_unknown_attr ua;
 	size_t start = mb->pos;
+	enum pkt_class cls;
 	(void)proto;
 
+	cls = pkt_classify(mb);
+
+	if (lcand) {
+		switch (cls) {
+
+		case PKT_STUN: ++lcand->stats.n_stun;  break;
+		case PKT_DTLS: ++lcand->stats.n_dtls;  break;
+		case PKT_RTP:  ++lcand->stats.n_rtp;   break;
+		default:       ++lcand->stats.n_other; break;
+		}
+	}
+
+	/* only genuine STUN is decoded, media passes straight through */
+	if (cls != PKT_STUN)
+		return false;  /* continue recv-processing */
+
 	if (stun_msg_decode(&msg, mb, &ua)) {
 		return false;  /* continue recv-processing */
 	}
@@ -474,10 +703,14 @@ bool trice_stun_process(struct trice *icem, struct ice_lcand *lcand,
 
 		case STUN_CLASS_REQUEST:
 			(void)trice_stund_recv(icem, lcand, sock,
-					      src, msg, start);
+					      src, msg, mb, start);
 			break;
 
 		default:
+			if (trice_conncheck_recv(icem, msg, &ua,
+						 mb, start) != ENOENT)
+				break;
+
 			if (icem->checklist) {
 				(void)stun_ctrans_recv(icem->checklist->stun,
 						       msg, &ua);
@@ -503,7 +736,6 @@ static void trice_reqbuf_destructor(void *data)
 
 	list_unlink(&reqbuf->le);
 
-	mem_deref(reqbuf->req);
 	mem_deref(reqbuf->sock);
 	mem_deref(reqbuf->lcand);
 }
@@ -511,13 +743,38 @@ static void trice_reqbuf_destructor(void *data)
 
 int trice_reqbuf_append(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz)
+		    const struct trice_stunreq *req, size_t presz)
 {
 	struct trice_reqbuf *reqbuf;
+	struct le *le;
 
 	if (!icem || !src ||!req)
 		return EINVAL;
 
+	/* only the latest request of a peer is kept */
+	for (le = list_head(&icem->reqbufl); le; le = le->next) {
+
+		reqbuf = le->data;
+
+		if (reqbuf->lcand != lcand)
+			continue;
+
+		if (!sa_cmp(&reqbuf->src, src, SA_ALL))
+			continue;
+
+		DEBUG_PRINTF("trice_reqbuf_append: Replacing request\n");
+		reqbuf->req = *req;
+		reqbuf->presz = presz;
+		++icem->reqbuf_ndup;
+
+		return 0;
+	}
+
+	if (icem->reqbufc >= TRICE_REQBUF_MAX) {
+		++icem->reqbuf_ndrop;
+		return EOVERFLOW;
+	}
+
 	reqbuf = mem_zalloc(sizeof(*reqbuf), trice_reqbuf_destructor);
 	if (!reqbuf)
 		return ENOMEM;
@@ -526,10 +783,11 @@ int trice_reqbuf_append(struct trice *icem, struct ice_lcand *lcand,
 	reqbuf->lcand = mem_ref(lcand);
 	reqbuf->sock = mem_ref(sock);
 	reqbuf->src = *src;
-	reqbuf->req = mem_ref(req);
+	reqbuf->req = *req;
 	reqbuf->presz = presz;
 
 	list_append(&icem->reqbufl, &reqbuf->le, reqbuf);
+	++icem->reqbufc;
 
 	return 0;
 }
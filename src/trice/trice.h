@@ -7,6 +7,70 @@
 
 struct ice_tcpconn;
 struct ice_conncheck;
+struct trice_skipn;
+struct trice_muxa;
+
+
+enum {
+	TRICE_CAND_HASH_SIZE = 32,   /**< Buckets in the candidate hashes  */
+	TRICE_PAIR_HASH_SIZE = 64,   /**< Buckets in the cand-pair hash    */
+	TRICE_FND_HASH_SIZE  = 16,   /**< Buckets in the foundation hashes */
+	TRICE_SKIP_LEVELS    = 8,    /**< Index levels of a pair list      */
+	TRICE_RESP_HASH_SIZE = 32,   /**< Buckets in the response cache    */
+	TRICE_RLIM_HASH_SIZE = 64,   /**< Buckets in the request limiter   */
+	TRICE_REQBUF_MAX     = 32,   /**< Max buffered requests, no role   */
+	TRICE_MUX_HASH_SIZE  = 4096, /**< Buckets in the shared socket     */
+	TRICE_CTRANS_HASH_SIZE = 32, /**< Checks in progress, by TID       */
+	TRICE_PAIR_STATES = ICE_CANDPAIR_FAILED + 1
+};
+
+
+/**
+ * Candidate pairs sorted by priority (highest first), with a skiplist
+ * index on top of the plain list for O(log n) insert and remove.
+ *
+ * NOTE: list must be the first member, the pair list is found through
+ *       the list pointer of the list element.
+ */
+struct trice_pairl {
+	struct list list;            /**< Candidate pairs (level 0)          */
+	struct trice_skipn *headv[TRICE_SKIP_LEVELS]; /**< Index levels     */
+	unsigned levels;             /**< Number of index levels in use      */
+};
+
+
+/**
+ * Candidate pairs in the same state, sorted by priority (highest first)
+ *
+ * NOTE: pairl must be the first member, the candidate pair finds its
+ *       bucket through the list pointer of its state element.
+ */
+struct trice_bucket {
+	struct trice_pairl pairl;    /**< Candidate pairs in this state     */
+	uint32_t n;                  /**< Number of pairs in this state     */
+};
+
+
+/** Encoded responses of the STUN server, for retransmitted requests */
+struct trice_respcache {
+	struct hash *ht;             /**< Entries, by transaction ID         */
+	struct list lru;             /**< Entries, most recent first         */
+	uint32_t n;                  /**< Number of entries                  */
+	uint64_t n_replay;           /**< Responses replayed from the cache  */
+};
+
+
+/** Token buckets of incoming STUN requests, per source address */
+struct trice_ratelim {
+	struct hash *ht;             /**< Sources, by address                */
+	struct list lru;             /**< Sources, most recent first         */
+	uint32_t n;                  /**< Number of sources                  */
+	uint64_t tokens;             /**< Shared bucket, while table is full */
+	uint64_t ts;                 /**< Last refill of the shared bucket   */
+	uint64_t n_pass;             /**< Requests admitted                  */
+	uint64_t n_drop;             /**< Requests dropped                   */
+	uint64_t n_shared;           /**< Requests on the shared bucket      */
+};
 
 
 /**
@@ -15,10 +79,13 @@ struct ice_conncheck;
 struct ice_checklist {
 	struct trice *icem;     /* parent */
 
-	struct tmr tmr_pace;         /**< Timer for pacing STUN requests     */
+	struct tmrw_ent tmr_pace;    /**< Timer for pacing STUN requests     */
+	struct trice_pacer *pacer;   /**< Shared pacer, replaces tmr_pace    */
+	struct le ple;               /**< Pacer list element                 */
 	uint32_t interval;           /**< Interval in [ms]                   */
 	struct stun *stun;           /**< STUN Transport                     */
 	struct list conncheckl;
+	struct hash *ctransh;        /**< Checks in progress, by TID         */
 	bool is_running;             /**< Checklist is running               */
 
 	/* callback handlers */
@@ -45,19 +112,51 @@ struct trice {
 
 	/* stun/authentication */
 	char *lufrag;                /**< Local Username fragment            */
+	size_t lufrag_len;           /**< Length of local Username fragment  */
 	char *lpwd;                  /**< Local Password                     */
+	struct hmac *lhmac;          /**< HMAC-SHA1 keyed with local pwd     */
 	char *rufrag;                /**< Remote Username fragment           */
+	size_t rufrag_len;           /**< Length of remote Username fragment */
 	char *rpwd;                  /**< Remote Password                    */
+	struct hmac *rhmac;          /**< HMAC-SHA1 keyed with remote pwd    */
+	char *username;              /**< USERNAME for outgoing checks       */
+	uint32_t chk_gen;            /**< Generation of the check templates  */
 
 	struct list lcandl;          /**< local candidates (add order)       */
 	struct list rcandl;          /**< remote candidates (add order)      */
-	struct list checkl;          /**< Check List of cand pairs (sorted)  */
-	struct list validl;          /**< Valid List of cand pairs (sorted)  */
+	struct hash *lcandh;         /**< local candidates (hashed)          */
+	struct hash *rcandh;         /**< remote candidates (hashed)         */
+	struct trice_pairl checkl;   /**< Check List of cand pairs (sorted)  */
+	struct trice_pairl validl;   /**< Valid List of cand pairs (sorted)  */
+	struct hash *pairh;          /**< cand pairs of checkl and validl    */
+	struct trice_bucket statev[TRICE_PAIR_STATES]; /**< pairs by state  */
+	struct hash *fndh;           /**< Interned foundations               */
+	struct hash *fndgrph;        /**< Pairs grouped by foundation        */
+	uint32_t fndc;               /**< Number of interned foundations     */
 	struct list reqbufl;         /**< buffered incoming requests         */
+	uint32_t reqbufc;            /**< Number of buffered requests        */
+	uint64_t reqbuf_ndup;        /**< Buffered requests replaced         */
+	uint64_t reqbuf_ndrop;       /**< Requests not buffered, full        */
+	struct trice_respcache respc; /**< Responses of the STUN server      */
+	struct trice_ratelim reqlim; /**< Admission of incoming requests     */
 
 	struct ice_checklist *checklist;
+	struct trice_pacer *pacer;   /**< Shared pacer (optional)            */
+	struct tmrw *tmrw;           /**< Timer wheel (optional)             */
+	struct trice_muxa *muxa;     /**< Shared socket, ICE-lite (optional) */
+
+	/* consent freshness */
+	struct list consentl;        /**< Consent of pairs, by due time      */
+	struct tmrw_ent tmr_consent; /**< Timer of the next consent check    */
+	struct stun *consent_stun;   /**< STUN Transport of consent checks   */
+	trice_consent_h *consenth;   /**< Consent expiry handler             */
+	void *consent_arg;           /**< Handler argument                   */
 
 	struct list connl;           /**< TCP-connections for all components */
+	trice_tcp_framev_h *tcp_framevh; /**< Handler of TCP media frames   */
+	void *tcp_framev_arg;        /**< Handler argument                   */
+	struct list txq;             /**< Queued checks, while corked        */
+	bool txcork;                 /**< Transmit queue is corked           */
 
 	char *sw;
 
@@ -69,6 +168,35 @@ struct trice {
 };
 
 
+/** Candidate foundation, interned to a small integer */
+struct trice_fnd {
+	struct le he;                /**< Hash element                       */
+	char str[32];                /**< Foundation string                  */
+	uint32_t id;                 /**< Foundation ID, starting from 1     */
+};
+
+
+/** Candidate pairs with the same (local, remote) foundation */
+struct trice_fndgrp {
+	struct le he;                /**< Hash element                       */
+	uint32_t lfnd;               /**< Local foundation ID                */
+	uint32_t rfnd;               /**< Remote foundation ID               */
+	struct list pairl;           /**< Candidate pairs in this group      */
+};
+
+
+/** The parts of an incoming Binding Request used by the STUN server */
+struct trice_stunreq {
+	uint8_t tid[STUN_TID_SIZE];  /**< Transaction ID                     */
+	uint16_t method;             /**< STUN method                        */
+	enum ice_role remote_role;   /**< Role of the peer, from attributes  */
+	uint64_t tiebrk;             /**< Tie-breaker of the peer            */
+	uint32_t prio;               /**< PRIORITY attribute                 */
+	bool has_prio;               /**< PRIORITY attribute is present      */
+	bool use_cand;               /**< USE-CANDIDATE attribute is present */
+};
+
+
 /**
  * Holds an unhandled STUN request message that will be handled once
  * the role has been determined.
@@ -78,7 +206,7 @@ struct trice_reqbuf {
 	struct ice_lcand *lcand;     /**< corresponding local candidate      */
 	void *sock;                  /**< request's socket                   */
 	struct sa src;               /**< source address                     */
-	struct stun_msg *req;        /**< buffered STUN request              */
+	struct trice_stunreq req;    /**< buffered STUN request              */
 	size_t presz;                /**< number of bytes in preamble        */
 };
 
@@ -113,15 +241,28 @@ struct ice_tcpconn {
 
 struct ice_conncheck {
 	struct le le;
+	struct le he;                 /* in ctransh, while in progress */
+	struct tmrw_ent tmr;          /* retransmission timer */
 	struct ice_candpair *pair;    /* pointer */
-	struct stun_ctrans *ct_conn;
 	struct trice *icem;           /* owner */
+	struct mbuf *mb;              /* encoded request */
+	size_t pos;                   /* start of the request in mb */
+	void *sock;                   /* udp_sock or tcp_conn */
+	struct sa dst;
+	int proto;
+	uint8_t tid[STUN_TID_SIZE];
+	uint64_t ts;                  /* time of sending, in [ms] */
+	uint32_t rto;                 /* retransmission timeout [ms] */
+	uint32_t ival;                /* current timeout [ms] */
+	uint32_t txc;                 /* transmissions */
 	bool use_cand;
 	bool term;
 };
 
 
 /* cand */
+uint32_t trice_cand_hash(unsigned compid, int proto, const struct sa *addr);
+int trice_fnd_intern(struct trice *icem, uint32_t *idp, const char *fnd);
 int trice_add_lcandidate(struct ice_lcand **candp,
 			 struct trice *icem, struct list *lst,
 			 unsigned compid, char *foundation, int proto,
@@ -137,15 +278,21 @@ int trice_rcands_debug(struct re_printf *pf, const struct list *lst);
 /* candpair */
 int  trice_candpair_alloc(struct ice_candpair **cpp, struct trice *icem,
 			 struct ice_lcand *lcand, struct ice_rcand *rcand);
-void trice_candpair_prio_order(struct list *lst, bool controlling);
+void trice_candpair_prio_order(struct trice *icem, bool controlling);
 void trice_candpair_make_valid(struct trice *icem, struct ice_candpair *pair);
-void trice_candpair_failed(struct ice_candpair *cp, int err, uint16_t scode);
-void trice_candpair_set_state(struct ice_candpair *cp,
+void trice_candpair_failed(struct trice *icem, struct ice_candpair *cp,
+			   int err, uint16_t scode);
+void trice_candpair_set_state(struct trice *icem, struct ice_candpair *cp,
 			     enum ice_candpair_state state);
+struct ice_candpair *trice_candpair_next(const struct trice *icem,
+					 enum ice_candpair_state state);
+uint32_t trice_candpair_count(const struct trice *icem,
+			      enum ice_candpair_state state);
 bool trice_candpair_iscompleted(const struct ice_candpair *cp);
 bool trice_candpair_cmp_fnd(const struct ice_candpair *cp1,
 			   const struct ice_candpair *cp2);
-struct ice_candpair *trice_candpair_find(const struct list *lst,
+struct ice_candpair *trice_candpair_find(const struct trice *icem,
+					const struct list *lst,
 					const struct ice_lcand *lcand,
 					const struct ice_rcand *rcand);
 int  trice_candpair_with_local(struct trice *icem, struct ice_lcand *lcand);
@@ -153,13 +300,87 @@ int  trice_candpair_with_remote(struct trice *icem, struct ice_rcand *rcand);
 const char    *trice_candpair_state2name(enum ice_candpair_state st);
 
 
+/* consent freshness */
+void trice_consent_auto(struct trice *icem, struct ice_candpair *pair);
+void trice_consent_flush(struct trice *icem);
+
+
+/* ICE-lite on a shared socket */
+void trice_mux_learn(struct trice_muxa *a, void *sock, const struct sa *src);
+int  trice_muxa_debug(struct re_printf *pf, const struct trice_muxa *a);
+
+
+/* round-trip time */
+void     trice_rtt_update(struct trice_rtt *rtt, uint32_t sample);
+uint32_t trice_rtt_rto(const struct trice_rtt *rtt, uint32_t rto_default);
+uint32_t trice_rtt_backoff(uint32_t rto, uint64_t elapsed);
+
+
+/* batched UDP receive */
+int trice_rxbatch_alloc(struct trice_rxbatch **rbp, struct ice_lcand *lcand,
+			uint32_t n);
+int trice_rxbatch_debug(struct re_printf *pf, const struct ice_lcand *lcand);
+
+
+/* shared pacer */
+void trice_pacer_attach(struct trice_pacer *pacer, struct ice_checklist *ic);
+void trice_pacer_detach(struct ice_checklist *ic);
+
+
+/* batched check transmission */
+void trice_txbatch_cork(struct trice *icem);
+bool trice_txbatch_queue(struct ice_lcand *lcand, const struct sa *dst,
+			 struct mbuf *mb);
+void trice_txbatch_flush(struct trice *icem);
+
+
+/* pair list */
+void trice_pairl_init(struct trice_pairl *pl);
+void trice_pairl_insert(struct trice_pairl *pl, struct le *le,
+			struct ice_candpair *cp);
+void trice_pairl_unlink(struct le *le);
+void trice_pairl_rekey(struct trice_pairl *pl);
+void trice_pairl_flush(struct trice_pairl *pl);
+void trice_pairl_clear(struct trice_pairl *pl);
+
+
+/* STUN message integrity */
+int trice_stun_chk_mi(struct hmac *hmac, struct mbuf *mb, size_t start);
+int trice_stun_append_mi(struct hmac *hmac, struct mbuf *mb, size_t start);
+int trice_stun_append_fp(struct mbuf *mb, size_t start);
+
+
 /* STUN server */
 int trice_stund_recv(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz);
+		    struct stun_msg *req, struct mbuf *mb, size_t presz);
 int trice_stund_recv_role_set(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz);
+		    const struct trice_stunreq *req, size_t presz);
+
+
+/* STUN server response cache */
+int  trice_respcache_init(struct trice_respcache *rc);
+void trice_respcache_flush(struct trice_respcache *rc);
+void trice_respcache_add(struct trice_respcache *rc,
+			 const struct ice_lcand *lcand, const struct sa *src,
+			 const uint8_t *tid, const uint8_t *buf, size_t len);
+bool trice_respcache_replay(struct trice_respcache *rc,
+			    struct ice_lcand *lcand, void *sock,
+			    const struct sa *src, const struct stun_msg *req,
+			    size_t presz);
+int  trice_respcache_debug(struct re_printf *pf,
+			   const struct trice_respcache *rc);
+
+
+/* STUN server admission control */
+int  trice_ratelim_init(struct trice_ratelim *rl);
+void trice_ratelim_flush(struct trice_ratelim *rl);
+bool trice_ratelim_admit(struct trice_ratelim *rl,
+			 const struct trice_conf *conf, const struct sa *src);
+int  trice_ratelim_debug(struct re_printf *pf,
+			 const struct trice_ratelim *rl,
+			 const struct trice_conf *conf);
 
 
 /* ICE media */
@@ -171,9 +392,10 @@ void trice_tracef(struct trice *icem, int color, const char *fmt, ...);
 /* ICE checklist */
 int  trice_checklist_debug(struct re_printf *pf,
 			   const struct ice_checklist *ic);
-void trice_conncheck_schedule_check(struct trice *icem);
+bool trice_conncheck_schedule_check(struct trice *icem);
 int  trice_checklist_update(struct trice *icem);
 void trice_checklist_refresh(struct trice *icem);
+bool trice_checklist_pace(struct ice_checklist *ic);
 
 
 /* ICE conncheck */
@@ -183,6 +405,9 @@ int trice_conncheck_stun_request(struct ice_checklist *ic,
 			       bool cc_use_cand);
 int trice_conncheck_trigged(struct trice *icem, struct ice_candpair *pair,
 			   void *sock, bool use_cand);
+int trice_conncheck_recv(struct trice *icem, const struct stun_msg *msg,
+			 const struct stun_unknown_attr *ua,
+			 struct mbuf *mb, size_t start);
 int trice_conncheck_debug(struct re_printf *pf,
 			  const struct ice_conncheck *cc);
 
@@ -205,4 +430,4 @@ bool trice_stun_process(struct trice *icem, struct ice_lcand *lcand,
 		       struct mbuf *mb);
 int trice_reqbuf_append(struct trice *icem, struct ice_lcand *lcand,
 		    void *sock, const struct sa *src,
-		    struct stun_msg *req, size_t presz);
+		    const struct trice_stunreq *req, size_t presz);
@@ -0,0 +1,230 @@
+/**
+ * @file txbatch.c  Batched transmission of ICE Connectivity Checks
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+#include <re_types.h>
+#include <re_fmt.h>
+#include <re_mem.h>
+#include <re_mbuf.h>
+#include <re_list.h>
+#include <re_tmr.h>
+#include <re_tmrw.h>
+#include <re_sa.h>
+#include <re_stun.h>
+#include <re_udp.h>
+#include <re_ice.h>
+#include <re_trice.h>
+#include "trice.h"
+
+
+#define DEBUG_MODULE "txbatch"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+/*
+ * While the transmit queue is corked, UDP packets sent through the
+ * helper of a local candidate are queued instead of being sent. The
+ * flush sends them with one sendmmsg() per socket.
+ *
+ * Packets are taken at the ICE helper, so UDP helpers registered below
+ * the ICE layer are not called for them. Relay candidates are never
+ * corked, their packets must go through the TURN client.
+ */
+
+
+#ifdef __linux__
+
+
+enum {
+	TXBATCH_MAX = 64
+};
+
+
+struct txent {
+	struct le le;
+	int fd;
+	struct sa dst;
+	struct mbuf *mb;
+	size_t pos;
+	size_t len;
+};
+
+
+static void txent_destructor(void *arg)
+{
+	struct txent *e = arg;
+
+	list_unlink(&e->le);
+	mem_deref(e->mb);
+}
+
+
+/**
+ * Cork the transmit queue of an ICE Media object
+ *
+ * @param icem ICE Media object
+ */
+void trice_txbatch_cork(struct trice *icem)
+{
+	if (!icem)
+		return;
+
+	icem->txcork = true;
+}
+
+
+/**
+ * Queue an outgoing UDP packet, if the transmit queue is corked
+ *
+ * @param lcand Local candidate owning the UDP helper
+ * @param dst   Destination address
+ * @param mb    Packet to send, from the current position
+ *
+ * @return True if the packet was queued, otherwise false
+ */
+bool trice_txbatch_queue(struct ice_lcand *lcand, const struct sa *dst,
+			 struct mbuf *mb)
+{
+	struct trice *icem;
+	struct txent *e;
+	int fd;
+
+	if (!lcand || !dst || !mb)
+		return false;
+
+	icem = lcand->icem;
+	if (!icem || !icem->txcork)
+		return false;
+
+	if (lcand->attr.type == ICE_CAND_TYPE_RELAY)
+		return false;
+
+	fd = udp_sock_fd(lcand->us, sa_af(dst));
+	if (fd < 0)
+		return false;
+
+	e = mem_zalloc(sizeof(*e), txent_destructor);
+	if (!e)
+		return false;
+
+	e->fd  = fd;
+	e->dst = *dst;
+	e->mb  = mem_ref(mb);
+	e->pos = mb->pos;
+	e->len = mbuf_get_left(mb);
+
+	list_append(&icem->txq, &e->le, e);
+
+	return true;
+}
+
+
+static void send_fd(struct list *txq, int fd)
+{
+	struct mmsghdr msgv[TXBATCH_MAX];
+	struct iovec iov[TXBATCH_MAX];
+	struct txent *ev[TXBATCH_MAX];
+	unsigned i, n = 0, off = 0;
+	struct le *le;
+
+	le = list_head(txq);
+	while (le && n < TXBATCH_MAX) {
+		struct txent *e = le->data;
+
+		le = le->next;
+
+		if (e->fd != fd)
+			continue;
+
+		iov[n].iov_base = e->mb->buf + e->pos;
+		iov[n].iov_len  = e->len;
+
+		memset(&msgv[n], 0, sizeof(msgv[n]));
+		msgv[n].msg_hdr.msg_name    = &e->dst.u.sa;
+		msgv[n].msg_hdr.msg_namelen = e->dst.len;
+		msgv[n].msg_hdr.msg_iov     = &iov[n];
+		msgv[n].msg_hdr.msg_iovlen  = 1;
+
+		ev[n++] = e;
+	}
+
+	while (off < n) {
+		int r = sendmmsg(fd, &msgv[off], n - off, 0);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* the STUN client retransmits lost checks */
+			DEBUG_NOTICE("sendmmsg: %u packets dropped (%m)\n",
+				     n - off, errno);
+			break;
+		}
+
+		off += r;
+	}
+
+	for (i=0; i<n; i++)
+		mem_deref(ev[i]);
+}
+
+
+/**
+ * Uncork the transmit queue and send all queued packets
+ *
+ * @param icem ICE Media object
+ */
+void trice_txbatch_flush(struct trice *icem)
+{
+	if (!icem)
+		return;
+
+	icem->txcork = false;
+
+	while (!list_isempty(&icem->txq)) {
+		struct txent *e = list_ledata(list_head(&icem->txq));
+
+		send_fd(&icem->txq, e->fd);
+	}
+}
+
+
+#else
+
+
+/* batching needs sendmmsg(), send everything right away */
+void trice_txbatch_cork(struct trice *icem)
+{
+	(void)icem;
+}
+
+
+bool trice_txbatch_queue(struct ice_lcand *lcand, const struct sa *dst,
+			 struct mbuf *mb)
+{
+	(void)lcand;
+	(void)dst;
+	(void)mb;
+
+	return false;
+}
+
+
+void trice_txbatch_flush(struct trice *icem)
+{
+	(void)icem;
+}
+
+
+#endif
@@ -0,0 +1,863 @@
+/**
+ * @file test.c  Tests and benchmarks for librew
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rew.h>
+
+
+#define DEBUG_MODULE "test"
+#define DEBUG_LEVEL 5
+#include <re_dbg.h>
+
+
+#define TEST_ERR(err)							\
+	if ((err)) {							\
+		DEBUG_WARNING("%s:%u: (%m)\n", __FILE__, __LINE__,	\
+			      (err));					\
+		goto out;						\
+	}
+
+#define TEST_ASSERT(expr)						\
+	if (!(expr)) {							\
+		DEBUG_WARNING("%s:%u: failed: %s\n", __FILE__, __LINE__, \
+			      #expr);					\
+		err = EINVAL;						\
+		goto out;						\
+	}
+
+
+static void bench_print(const char *name, uint64_t n, uint64_t ms)
+{
+	(void)re_printf("  %-32s %10llu in %6llu ms  (%llu/s)\n", name, n, ms,
+			ms ? n * 1000 / ms : n * 1000);
+}
+
+
+static void dummy_estab(struct ice_candpair *pair,
+			const struct stun_msg *msg, void *arg)
+{
+	(void)pair;
+	(void)msg;
+	(void)arg;
+}
+
+
+static void dummy_failed(int err, uint16_t scode,
+			 struct ice_candpair *pair, void *arg)
+{
+	(void)err;
+	(void)scode;
+	(void)pair;
+	(void)arg;
+}
+
+
+/* an ICE agent with one UDP host candidate and one remote candidate */
+static int agent_alloc(struct trice **icemp, enum ice_role role,
+		       const char *lufrag, const char *lpwd,
+		       const char *rufrag, const char *rpwd)
+{
+	struct trice *icem = NULL;
+	struct ice_lcand *lcand;
+	struct sa laddr, raddr;
+	int err;
+
+	err  = sa_set_str(&laddr, "127.0.0.1", 0);
+	err |= sa_set_str(&raddr, "127.0.0.1", 9);
+	TEST_ERR(err);
+
+	err = trice_alloc(&icem, NULL, role, lufrag, lpwd);
+	TEST_ERR(err);
+
+	err  = trice_set_remote_ufrag(icem, rufrag);
+	err |= trice_set_remote_pwd(icem, rpwd);
+	TEST_ERR(err);
+
+	err = trice_lcand_add(&lcand, icem, 1, IPPROTO_UDP, 0x7e0000ff,
+			      &laddr, NULL, ICE_CAND_TYPE_HOST, NULL, 0,
+			      NULL, 0);
+	TEST_ERR(err);
+
+	err = trice_rcand_add(NULL, icem, 1, "1", IPPROTO_UDP, 0x7e0000ff,
+			      &raddr, ICE_CAND_TYPE_HOST, 0);
+	TEST_ERR(err);
+
+ out:
+	if (err)
+		mem_deref(icem);
+	else
+		*icemp = icem;
+
+	return err;
+}
+
+
+/*
+ * Connectivity checks sent per second, each check copied from the
+ * encoded template of its local candidate, against the same request
+ * encoded and signed by the generic STUN encoder.
+ */
+static int bench_conncheck(void)
+{
+	enum { N = 20000 };
+	static const char rpwd[] = "rpwd-rpwd-rpwd-rpwd-rpwd";
+	struct trice *icem = NULL;
+	struct ice_candpair *pair;
+	struct mbuf *mb = NULL;
+	uint64_t tiebrk = 1;
+	void *sock;
+	uint64_t t0;
+	unsigned i;
+	int err;
+
+	err = agent_alloc(&icem, ICE_ROLE_CONTROLLING,
+			  "lufrag", "lpwd-lpwd-lpwd-lpwd-lpwd",
+			  "rufrag", rpwd);
+	TEST_ERR(err);
+
+	err = trice_checklist_start(icem, NULL, 20, dummy_estab,
+				    dummy_failed, NULL);
+	TEST_ERR(err);
+
+	pair = list_ledata(list_head(trice_checkl(icem)));
+	TEST_ASSERT(pair != NULL);
+
+	sock = trice_lcand_sock(icem, pair->lcand);
+	TEST_ASSERT(sock != NULL);
+
+	t0 = tmr_jiffies();
+
+	for (i=0; i<N; i++) {
+		err = trice_conncheck_send(icem, pair, false);
+		TEST_ERR(err);
+	}
+
+	bench_print("conncheck send (template)", N, tmr_jiffies() - t0);
+
+	mb = mbuf_alloc(256);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	t0 = tmr_jiffies();
+
+	for (i=0; i<N; i++) {
+		uint8_t tid[STUN_TID_SIZE];
+
+		rand_bytes(tid, sizeof(tid));
+
+		mbuf_rewind(mb);
+
+		err = stun_msg_encode(mb, STUN_METHOD_BINDING,
+				      STUN_CLASS_REQUEST, tid, NULL,
+				      (uint8_t *)rpwd, sizeof(rpwd) - 1,
+				      true, 0x00, 3,
+				      STUN_ATTR_USERNAME, "rufrag:lufrag",
+				      STUN_ATTR_PRIORITY,
+				      &pair->lcand->prio_prflx,
+				      STUN_ATTR_CONTROLLING, &tiebrk);
+		TEST_ERR(err);
+
+		mb->pos = 0;
+
+		err = stun_send(IPPROTO_UDP, sock,
+				&pair->rcand->attr.addr, mb);
+		TEST_ERR(err);
+	}
+
+	bench_print("conncheck send (generic)", N, tmr_jiffies() - t0);
+
+ out:
+	mem_deref(mb);
+	trice_checklist_stop(icem);
+	mem_deref(icem);
+
+	return err;
+}
+
+
+/*
+ * Binding Requests handled per second by the STUN server of an agent,
+ * including the split of the USERNAME attribute.
+ */
+static int bench_stunsrv(void)
+{
+	enum { N = 20000 };
+	static const char lpwd[] = "lpwd-lpwd-lpwd-lpwd-lpwd";
+	static const char rpwd[] = "rpwd-rpwd-rpwd-rpwd-rpwd";
+	struct trice *icem = NULL;
+	struct ice_lcand *lcand;
+	struct mbuf **mbv = NULL;
+	uint32_t prio = 0x6e0001ff;
+	uint64_t tiebrk = 1;
+	struct sa src;
+	uint64_t t0;
+	unsigned i;
+	int err;
+
+	err = agent_alloc(&icem, ICE_ROLE_CONTROLLING,
+			  "lufrag", lpwd, "rufrag", rpwd);
+	TEST_ERR(err);
+
+	lcand = list_ledata(list_head(trice_lcandl(icem)));
+	TEST_ASSERT(lcand != NULL);
+
+	err = sa_set_str(&src, "127.0.0.1", 9);
+	TEST_ERR(err);
+
+	mbv = mem_zalloc(N * sizeof(*mbv), NULL);
+	if (!mbv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* a new transaction for each request, none is a retransmission */
+	for (i=0; i<N; i++) {
+		uint8_t tid[STUN_TID_SIZE];
+
+		rand_bytes(tid, sizeof(tid));
+
+		mbv[i] = mbuf_alloc(256);
+		if (!mbv[i]) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		err = stun_msg_encode(mbv[i], STUN_METHOD_BINDING,
+				      STUN_CLASS_REQUEST, tid, NULL,
+				      (uint8_t *)lpwd, strlen(lpwd), true,
+				      0x20, 3,
+				      STUN_ATTR_USERNAME, "lufrag:rufrag",
+				      STUN_ATTR_PRIORITY, &prio,
+				      STUN_ATTR_CONTROLLED, &tiebrk);
+		TEST_ERR(err);
+
+		mbv[i]->pos = 0;
+	}
+
+	t0 = tmr_jiffies();
+
+	for (i=0; i<N; i++)
+		trice_lcand_recv_packet(lcand, &src, mbv[i]);
+
+	bench_print("stun server binding request", N, tmr_jiffies() - t0);
+
+ out:
+	for (i=0; mbv && i<N; i++)
+		mem_deref(mbv[i]);
+
+	mem_deref(mbv);
+	mem_deref(icem);
+
+	return err;
+}
+
+
+static struct {
+	unsigned n;
+	unsigned fired;
+} tmrs;
+
+
+static void tmr_handler(void *arg)
+{
+	(void)arg;
+
+	if (++tmrs.fired == tmrs.n)
+		re_cancel();
+}
+
+
+/*
+ * Starting and cancelling timers, on the main timer list and on a
+ * timer wheel, and running them to expiry.
+ */
+static int tmrw_bench_run(unsigned n)
+{
+	enum { SPREAD = 1000 };
+	struct tmrw_ent *tv = NULL;
+	struct tmr *mv = NULL;
+	struct tmrw *w = NULL;
+	uint64_t t0;
+	unsigned i;
+	int err;
+
+	(void)re_printf("  %u timers:\n", n);
+
+	tv = mem_zalloc(n * sizeof(*tv), NULL);
+	mv = mem_zalloc(n * sizeof(*mv), NULL);
+	if (!tv || !mv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = tmrw_alloc(&w, 10);
+	TEST_ERR(err);
+
+	for (i=0; i<n; i++) {
+		tmr_init(&mv[i]);
+		tmrw_init(&tv[i]);
+	}
+
+	t0 = tmr_jiffies();
+
+	for (i=0; i<n; i++)
+		tmr_start(&mv[i], 1000 + rand_u32() % SPREAD, tmr_handler,
+			  NULL);
+	for (i=0; i<n; i++)
+		tmr_cancel(&mv[i]);
+
+	bench_print("tmr start/cancel", n, tmr_jiffies() - t0);
+
+	t0 = tmr_jiffies();
+
+	for (i=0; i<n; i++)
+		tmrw_start(w, &tv[i], 1000 + rand_u32() % SPREAD,
+			   tmr_handler, NULL);
+	for (i=0; i<n; i++)
+		tmrw_cancel(&tv[i]);
+
+	bench_print("tmrw start/cancel", n, tmr_jiffies() - t0);
+
+	/* all timers expire within one second */
+	tmrs.n     = n;
+	tmrs.fired = 0;
+
+	for (i=0; i<n; i++)
+		tmrw_start(w, &tv[i], rand_u32() % SPREAD, tmr_handler, NULL);
+
+	t0 = tmr_jiffies();
+
+	err = re_main(NULL);
+	TEST_ERR(err);
+
+	TEST_ASSERT(tmrs.fired == n);
+
+	bench_print("tmrw expired", n, tmr_jiffies() - t0);
+	(void)re_printf("  %H\n", tmrw_debug, w);
+
+ out:
+	for (i=0; tv && i<n; i++)
+		tmrw_cancel(&tv[i]);
+
+	mem_deref(w);
+	mem_deref(mv);
+	mem_deref(tv);
+
+	return err;
+}
+
+
+static int bench_tmrw(void)
+{
+	int err;
+
+	err = tmrw_bench_run(10000);
+	if (err)
+		return err;
+
+	return tmrw_bench_run(100000);
+}
+
+
+/* a TCP connection on the loopback, with SHIM on the accepted side */
+struct shim_link {
+	struct tcp_sock *ts;
+	struct tcp_conn *tca;        /* accepted, receiving */
+	struct tcp_conn *tcc;        /* connected, sending  */
+	struct shim *shima;
+	struct shim *shimc;          /* only with SHIM on the sender */
+	struct tmr tmr;
+	shim_frame_h *frameh;
+	shim_framev_h *framevh;
+	tcp_estab_h *estabh;
+	void *arg;
+	bool shim_tx;
+	int err;
+};
+
+
+static void link_abort(struct shim_link *l, int err)
+{
+	if (!l->err)
+		l->err = err;
+
+	re_cancel();
+}
+
+
+static void link_timeout(void *arg)
+{
+	link_abort(arg, ETIMEDOUT);
+}
+
+
+static void link_close_handler(int err, void *arg)
+{
+	link_abort(arg, err ? err : ECONNRESET);
+}
+
+
+static void link_estab_handler(void *arg)
+{
+	struct shim_link *l = arg;
+
+	if (l->estabh)
+		l->estabh(l->arg);
+}
+
+
+static void link_conn_handler(const struct sa *peer, void *arg)
+{
+	struct shim_link *l = arg;
+	int err;
+	(void)peer;
+
+	err = tcp_accept(&l->tca, l->ts, NULL, NULL, link_close_handler, l);
+	if (err)
+		goto out;
+
+	err = shim_insert(&l->shima, l->tca, 0, NULL, l->frameh, l->arg);
+	if (err)
+		goto out;
+
+	shim_set_framev_handler(l->shima, l->framevh);
+
+ out:
+	if (err)
+		link_abort(l, err);
+}
+
+
+static int link_open(struct shim_link *l, bool shim_tx,
+		     shim_frame_h *frameh, shim_framev_h *framevh,
+		     tcp_estab_h *estabh, void *arg)
+{
+	struct sa laddr;
+	int err;
+
+	memset(l, 0, sizeof(*l));
+	tmr_init(&l->tmr);
+
+	l->shim_tx = shim_tx;
+	l->frameh  = frameh;
+	l->framevh = framevh;
+	l->estabh  = estabh;
+	l->arg     = arg;
+
+	err = sa_set_str(&laddr, "127.0.0.1", 0);
+	if (err)
+		return err;
+
+	err = tcp_listen(&l->ts, &laddr, link_conn_handler, l);
+	if (err)
+		return err;
+
+	err = tcp_local_get(l->ts, &laddr);
+	if (err)
+		return err;
+
+	err = tcp_connect(&l->tcc, &laddr, link_estab_handler, NULL,
+			  link_close_handler, l);
+	if (err)
+		return err;
+
+	if (shim_tx) {
+		err = shim_insert(&l->shimc, l->tcc, 0, NULL, l->frameh,
+				  l->arg);
+		if (err)
+			return err;
+	}
+
+	tmr_start(&l->tmr, 30000, link_timeout, l);
+
+	return 0;
+}
+
+
+static void link_close(struct shim_link *l)
+{
+	tmr_cancel(&l->tmr);
+
+	/* note: helper must be closed before tc */
+	l->shima = mem_deref(l->shima);
+	l->shimc = mem_deref(l->shimc);
+	l->tca   = mem_deref(l->tca);
+	l->tcc   = mem_deref(l->tcc);
+	l->ts    = mem_deref(l->ts);
+}
+
+
+/*
+ * Frames are delivered as soon as they are complete: the frames of a
+ * segment are not held back by a frame that the handler passes on, and
+ * a frame split across segments is delivered with its last segment.
+ */
+static const size_t lat_sizev[] = {100, 200, 300, 1000, 50};
+
+enum {
+	LAT_COALESCED = 3,           /* Frames in the first segment   */
+	LAT_SPLIT     = 400,         /* Bytes of frame 4 in segment 1 */
+};
+
+
+static struct {
+	struct shim_link link;
+	struct tmr tmr;
+	struct mbuf *mb;
+	size_t nrx;
+} lat;
+
+
+static void lat_send(size_t start, size_t end)
+{
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(end - start);
+	if (!mb) {
+		link_abort(&lat.link, ENOMEM);
+		return;
+	}
+
+	err = mbuf_write_mem(mb, lat.mb->buf + start, end - start);
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+
+	err = tcp_send(lat.link.tcc, mb);
+
+ out:
+	mem_deref(mb);
+
+	if (err)
+		link_abort(&lat.link, err);
+}
+
+
+static size_t lat_offset(size_t nframes)
+{
+	size_t i, off = 0;
+
+	for (i=0; i<nframes; i++)
+		off += 2 + lat_sizev[i];
+
+	return off;
+}
+
+
+static void lat_second(void *arg)
+{
+	(void)arg;
+
+	/* the coalesced frames arrived, without waiting for more data */
+	if (lat.nrx != LAT_COALESCED) {
+		link_abort(&lat.link, EPROTO);
+		return;
+	}
+
+	lat_send(lat_offset(LAT_COALESCED) + 2 + LAT_SPLIT, lat.mb->end);
+}
+
+
+static void lat_estab(void *arg)
+{
+	(void)arg;
+
+	lat_send(0, lat_offset(LAT_COALESCED) + 2 + LAT_SPLIT);
+
+	tmr_start(&lat.tmr, 100, lat_second, NULL);
+}
+
+
+static bool lat_frame(struct mbuf *mb, void *arg)
+{
+	(void)mb;
+	(void)arg;
+
+	/* passed on to the vector handler */
+	return false;
+}
+
+
+static void lat_framev(struct mbuf **mbv, size_t n, void *arg)
+{
+	size_t i;
+	(void)arg;
+
+	for (i=0; i<n; i++) {
+
+		const size_t k = lat.nrx;
+
+		if (k >= ARRAY_SIZE(lat_sizev) ||
+		    mbuf_get_left(mbv[i]) != lat_sizev[k] ||
+		    mbuf_buf(mbv[i])[0] != (uint8_t)k) {
+			link_abort(&lat.link, EPROTO);
+			return;
+		}
+
+		if (++lat.nrx == ARRAY_SIZE(lat_sizev))
+			re_cancel();
+	}
+}
+
+
+static int test_shim_latency(void)
+{
+	size_t i;
+	int err;
+
+	memset(&lat, 0, sizeof(lat));
+	tmr_init(&lat.tmr);
+
+	lat.mb = mbuf_alloc(lat_offset(ARRAY_SIZE(lat_sizev)));
+	if (!lat.mb)
+		return ENOMEM;
+
+	for (i=0; i<ARRAY_SIZE(lat_sizev); i++) {
+
+		err  = mbuf_write_u16(lat.mb, htons((uint16_t)lat_sizev[i]));
+		err |= mbuf_fill(lat.mb, (uint8_t)i, lat_sizev[i]);
+		TEST_ERR(err);
+	}
+
+	err = link_open(&lat.link, false, lat_frame, lat_framev,
+			lat_estab, NULL);
+	TEST_ERR(err);
+
+	err = re_main(NULL);
+	TEST_ERR(err);
+
+	err = lat.link.err;
+	TEST_ERR(err);
+
+	TEST_ASSERT(lat.nrx == ARRAY_SIZE(lat_sizev));
+
+ out:
+	tmr_cancel(&lat.tmr);
+	link_close(&lat.link);
+	lat.mb = mem_deref(lat.mb);
+
+	return err;
+}
+
+
+enum {
+	SHIM_BENCH_BATCH  = 16,      /* Frames per send          */
+	SHIM_BENCH_WINDOW = 64,      /* Frames sent, not yet received */
+};
+
+
+static struct {
+	struct shim_link link;
+	struct mbuf *mb;
+	size_t n;
+	size_t ntx;
+	size_t nrx;
+} shb;
+
+
+static void shim_bench_send(size_t n)
+{
+	struct mbuf *mbv[SHIM_BENCH_BATCH];
+	size_t i;
+	int err;
+
+	n = min(n, shb.n - shb.ntx);
+	if (!n)
+		return;
+
+	for (i=0; i<n; i++)
+		mbv[i] = shb.mb;
+
+	err = shim_sendv(shb.link.shimc, mbv, n);
+	if (err) {
+		link_abort(&shb.link, err);
+		return;
+	}
+
+	shb.ntx += n;
+}
+
+
+static void shim_bench_estab(void *arg)
+{
+	unsigned i;
+	(void)arg;
+
+	for (i=0; i<SHIM_BENCH_WINDOW / SHIM_BENCH_BATCH; i++)
+		shim_bench_send(SHIM_BENCH_BATCH);
+}
+
+
+static bool shim_bench_frame(struct mbuf *mb, void *arg)
+{
+	(void)arg;
+
+	if (mbuf_get_left(mb) != mbuf_get_left(shb.mb)) {
+		link_abort(&shb.link, EPROTO);
+		return true;
+	}
+
+	if (++shb.nrx == shb.n)
+		re_cancel();
+	else if (shb.nrx % SHIM_BENCH_BATCH == 0)
+		shim_bench_send(SHIM_BENCH_BATCH);
+
+	return true;
+}
+
+
+static int shim_bench_run(size_t size, size_t n, uint64_t *msp)
+{
+	uint64_t t0;
+	int err;
+
+	memset(&shb, 0, sizeof(shb));
+
+	shb.n  = n;
+	shb.mb = mbuf_alloc(size);
+	if (!shb.mb)
+		return ENOMEM;
+
+	err = mbuf_fill(shb.mb, 0xa5, size);
+	if (err)
+		goto out;
+
+	shb.mb->pos = 0;
+
+	err = link_open(&shb.link, true, shim_bench_frame, NULL,
+			shim_bench_estab, NULL);
+	if (err)
+		goto out;
+
+	t0 = tmr_jiffies();
+
+	err = re_main(NULL);
+	if (err)
+		goto out;
+
+	*msp = tmr_jiffies() - t0;
+
+	err = shb.link.err;
+	if (err)
+		goto out;
+
+	if (shb.nrx != n)
+		err = EPROTO;
+
+ out:
+	link_close(&shb.link);
+	shb.mb = mem_deref(shb.mb);
+
+	return err;
+}
+
+
+/*
+ * Frames per second through SHIM on a TCP connection on the loopback,
+ * for small and for the largest frames.
+ */
+static int bench_shim(void)
+{
+	uint64_t ms;
+	int err;
+
+	err = shim_bench_run(1024, 200000, &ms);
+	TEST_ERR(err);
+
+	bench_print("shim 1k frames", 200000, ms);
+
+	err = shim_bench_run(65535, 5000, &ms);
+	TEST_ERR(err);
+
+	bench_print("shim 64k frames", 5000, ms);
+
+ out:
+	return err;
+}
+
+
+/*
+ * Re-assembly buffers taken per million frames through SHIM, from the
+ * buffer pool and from the heap.
+ */
+static int bench_mbpool(void)
+{
+	enum { N = 1000000 };
+	struct mbpool_stats s0, s1;
+	uint64_t ms;
+	int err;
+
+	mbpool_stats_get(&s0);
+
+	err = shim_bench_run(1024, N, &ms);
+	TEST_ERR(err);
+
+	mbpool_stats_get(&s1);
+
+	bench_print("shim 1k frames, pooled buffers", N, ms);
+	(void)re_printf("  %-32s %10llu pooled, %llu allocated\n",
+			"buffers per million frames",
+			s1.n_hit - s0.n_hit, s1.n_miss - s0.n_miss);
+
+ out:
+	return err;
+}
+
+
+int main(void)
+{
+	int err;
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	err = test_shim_latency();
+	if (err)
+		goto out;
+
+	(void)re_printf("benchmarks:\n");
+
+	err = bench_conncheck();
+	if (err)
+		goto out;
+
+	err = bench_stunsrv();
+	if (err)
+		goto out;
+
+	err = bench_tmrw();
+	if (err)
+		goto out;
+
+	err = bench_shim();
+	if (err)
+		goto out;
+
+	err = bench_mbpool();
+	if (err)
+		goto out;
+
+ out:
+	/* buffers kept in the pool are not leaks */
+	mbpool_flush();
+
+	libre_close();
+
+	tmr_debug();
+	mem_debug();
+
+	if (err)
+		(void)re_fprintf(stderr, "test failed (%m)\n", err);
+	else
+		(void)re_printf("test ok\n");
+
+	return err;
+}